@@ -12,8 +12,16 @@
 #include <fstream>
 #include "asm/parser.h"
 #include "asm/source_iterator.h"
+#include "asm/program.h"
+#include "asm/arena.h"
+#include "asm/instruction.h"
 #include "asm/utils.h"
 #include "asm/types.h"
+#include "asm/object.h"
+#include "asm/thread_pool.h"
+#include "asm/batch_io.h"
+#include "asm/server.h"
+#include "asm/object_cache.h"
 
 namespace ASM {
 	using string = std::string;
@@ -22,41 +30,73 @@ namespace ASM {
 
 	namespace streams {
 		auto& warning = std::cerr;
-		auto& log = std::cout;
 		auto& error = std::cerr;
 	}
 
-	hashvec<Symbol> symtable;
-	hashvec<Section> sections;
-	vector<Relocation> relocations;
-	hashvec<Constant> constants;
-	hashvec<Instruction, hashvec_traits_icase> optable = {
-		{"nop", Nop},
-		{"halt", Nop},
-		{"xchg", E},
-		{"int"},
-		{"mov", Z | N | E},
-		{"add", Z | O | C | N | E},
-		{"sub", Z | O | C | N | E},
-		{"mul", Z | N | E},
-		{"div", Z | N | E},
-		{"cmp", Z | O | C | N | E},
-		{"not", Z | N | E},
-		{"and", Z | N | E},
-		{"or", Z | N | E},
-		{"xor", Z | N | E},
-		{"test", Z | N | E},
-		{"shl", Z | C | N | E},
-		{"shr", Z | C | N | E},
-		{"push"},
-		{"pop"},
-		{"jmp"},
-		{"jeq"},
-		{"jne"},
-		{"jgt"},
-		{"call"},
-		{"ret"},
-		{"iret"}
+	// counters of the last assembly run
+	struct stats_t {
+		size_t lines = 0; // non empty source lines
+		size_t arena_bytes = 0; // memory taken by the arena
+		size_t cache_hits = 0, cache_misses = 0; // objects taken from and added to the cache
+	};
+
+	// Everything a single assembly works on. Instances share no mutable state, so separate
+	// ones can assemble different files from different threads at the same time.
+	class Assembler {
+		friend class Pass;
+		arena memory; // released after every run, backs the recorded program and interned names
+		interner names{ memory }; // symbol names referenced by instructions
+
+		string run(const source_file& source);
+	public:
+		string input_path, output_path;
+		parser_engine engine = parser_engine::LEXER;
+		object_format format = object_format::TEXT;
+		std::ostream* log = &std::cout; // pass trace and resulting tables
+		const object_cache* cache = nullptr; // objects of sources assembled before, kept across reset
+
+		hashvec<Symbol> symtable;
+		hashvec<Section> sections;
+		relocation_table relocations;
+		hashvec<Constant> constants;
+		stats_t stats;
+		bool included = false; // source pulled in other files with .incbin, its object is not cached
+
+		Assembler() = default;
+		Assembler(const string& input, const string& output, parser_engine parser = parser_engine::LEXER, object_format output_format = object_format::TEXT) {
+			reset(input, output, parser, output_format);
+		}
+		Assembler(const Assembler&) = delete;
+		Assembler& operator=(const Assembler&) = delete;
+
+		// prepares for assembling another file, tables keep their storage
+		void reset(const string& input, const string& output, parser_engine parser = parser_engine::LEXER, object_format output_format = object_format::TEXT) {
+			input_path = input;
+			output_path = output;
+			engine = parser;
+			format = output_format;
+
+			symtable.clear();
+			sections.clear();
+			relocations.clear();
+			constants.clear();
+			names = interner{ memory };
+			memory.release();
+			stats = stats_t{};
+			included = false;
+		}
+		// assembles source and returns contents of the object file, nothing is written
+		// with a cache, known sources are not assembled and tables stay empty
+		string build(const source_file& source);
+		// name of the object of source in a cache, objects of sources with .incbin are never stored under it
+		static string cache_key(std::string_view source, parser_engine engine, object_format format) {
+			// object depends only on the source bytes, the assembler version and these options
+			return object_cache::key(source, utils::string_format("parser=%d format=%d", (int)engine, (int)format));
+		}
+		void assemble() {
+			source_file source(input_path);
+			write_file(output_path, build(source));
+		}
 	};
 
 	struct TypeManager {
@@ -69,294 +109,535 @@ namespace ASM {
 		virtual void onEqu(parsed_t& data) {}
 		virtual void onWord(parsed_t& data) {}
 		virtual void onInstruction(parsed_t& data) {}
+		virtual void onIncbin(parsed_t& data) {}
+		virtual void onAscii(parsed_t& data) {}
 	};
 
-	//logging stream
+	// byte range of a file embedded with .incbin
+	struct incbin_t {
+		string path;
+		size_t offset = 0;
+		size_t length = 0;
+	};
+	// range is checked against file metadata only, relative paths are taken from the source file directory
+	static incbin_t incbin_range(const parsed_t& data, const string& input_path) {
+		incbin_t range{ string(data.values[0]) };
+		size_t slash = input_path.rfind('/');
+		if (range.path[0] != '/' && slash != string::npos)
+			range.path = input_path.substr(0, slash + 1) + range.path;
+
+		struct stat info;
+		if (::stat(range.path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+			throw syntax_error("Cannot include file " + range.path);
+		size_t size = info.st_size;
+		range.offset = data.values[1].empty() ? 0 : utils::stoi(data.values[1]);
+		range.length = data.values[2].empty() ? size - std::min(range.offset, size) : utils::stoi(data.values[2]);
+		if (range.offset > size || range.length > size - range.offset)
+			throw syntax_error("Included range is past the end of " + range.path);
+		return range;
+	}
+
 	class Pass: protected TypeManager {
+		token section_name; // name of current section, id is looked up again only when it changes
 	protected:
-		// helper function to fetch proper operand size
-		static int get_op_sz(const string& instruction, const flags_t& flags) {
-			if (!optable.has(instruction))
-				throw std::runtime_error("Instruction not in optable");
-			if (optable[instruction].flags & Nop) // no operands
-				return 0;
-			else if (optable[instruction].flags & E) // variable operands
-				return flags & EXTENDED ? DWORD_SZ : WORD_SZ;
-			else
-				return DWORD_SZ;
+		Assembler& context;
+		// tables of the context, named as handlers use them
+		std::ostream& log;
+		hashvec<Symbol>& symtable;
+		hashvec<Section>& sections;
+		relocation_table& relocations;
+		hashvec<Constant>& constants;
+		interner& names;
+		uint32_t section = 0; // index of current section in section table
+
+		// dispatches parsed elements of a single line to their handlers
+		template <typename It>
+		void process_line(int line_num, token line, token line_section, It first, It last) {
+			log << line_section << ":\t";
+			if (line_section != section_name) {
+				section_name = line_section;
+				section = sections[line_section].index;
+			}
+			for (; first != last; ++first) {
+				parsed_t& datum = *first;
+				//print parsed line on string
+				for (auto& value : datum.values)
+					log << value << " || ";
+
+				try {
+					if (datum.flags & SKIP) onSkip(datum);
+					else if (datum.flags & ALIGN) onAlign(datum);
+					else if (datum.flags & ALLOC) onAlloc(datum);
+					else if (datum.flags & LABEL) onLabel(datum);
+					else if (datum.flags & SECTION) onSection(datum);
+					else if (datum.flags & RELOC) onReloc(datum);
+					else if (datum.flags & EQU) onEqu(datum);
+					else if (datum.flags & WORD) onWord(datum);
+					else if (datum.flags & INSTRUCTION) onInstruction(datum);
+					else if (datum.flags & INCBIN) onIncbin(datum);
+					else if (datum.flags & ASCII) onAscii(datum);
+					else throw std::runtime_error("Irregular type, handler not provided");
+				} catch (syntax_error& err) {
+					// assembly of this file stops, the caller decides what happens to the rest
+					throw line_error(utils::string_format("%s @ line:%d = %.*s", err.what(), line_num, (int)line.size(), line.data()));
+				}
+
+				log << sections[section].counter;
+
+			}
+			log << '\n';
 		}
-		string section = "UND";
 	public:
-		void process(const string& input_path) {
-			streams::log << "pass starting: \n";
-
-			for (source_iterator iter(input_path); (iter != EOF) || (iter->data[0].flags & END); ++iter) {
-				streams::log << iter->section << ":\t";
-				section = iter->section;
-				for (auto& datum : iter->data) {
-					//print parsed line on string
-					for (auto& value : datum.values)
-						streams::log << value << " || ";
-
-					try {
-						if (datum.flags & SKIP) onSkip(datum);
-						else if (datum.flags & ALIGN) onAlign(datum);
-						else if (datum.flags & ALLOC) onAlloc(datum);
-						else if (datum.flags & LABEL) onLabel(datum);
-						else if (datum.flags & SECTION) onSection(datum);
-						else if (datum.flags & RELOC) onReloc(datum);
-						else if (datum.flags & EQU) onEqu(datum);
-						else if (datum.flags & WORD) onWord(datum);
-						else if (datum.flags & INSTRUCTION) onInstruction(datum);
-						else throw std::runtime_error("Irregular type, handler not provided");
-					} catch (syntax_error& err) {
-						streams::error << string_format("%s @ line:%d = %s", err.what(), iter->line_num, iter->line);
-						std::terminate();
-					} catch (std::exception& err) {
-						streams::error << err.what();
-						std::terminate();
-					}
-
-					streams::log << sections[iter->section].counter;
-					
-				}
-				streams::log << '\n';
+		Pass(Assembler& context) : context(context), log(*context.log), symtable(context.symtable), sections(context.sections),
+			relocations(context.relocations), constants(context.constants), names(context.names) {}
+
+		// parses the source and records every line after it was handled, so decisions
+		// taken by handlers (like shortened displacements) carry over to later passes
+		void process(const source_file& source, program& recording) {
+			log << "pass starting: \n";
+			for (source_iterator iter(source, context.engine); (iter != EOF) || (iter->data[0].flags & END); ++iter) {
+				process_line(iter->line_num, iter->line, iter->section, iter->data.begin(), iter->data.end());
+				recording.record(*iter);
+			}
+			log << "pass end.\n";
+		}
+		// replays recorded program, the source is not read nor parsed again
+		void process(const program& recording) {
+			log << "pass starting: \n";
+			vector<parsed_t> data; // handlers get a copy so recording stays intact
+			for (auto& line : recording) {
+				data.assign(recording.begin(line), recording.end(line));
+				process_line(line.line_num, line.line, line.section, data.begin(), data.end());
 			}
-			streams::log << "pass end.\n";
+			log << "pass end.\n";
 		}
 	};
 
 	class FirstPass: public Pass {
+	public:
+		using Pass::Pass;
+	private:
 		void onSection(parsed_t& data) override {
-			const std::string& section_name = data.values[0];
+			token section_name = data.values[0];
 			// create section entry if it doesn't exist
-			if (!sections.has(section_name))
-				sections.put(section_name, Section{});
+			sections.emplace(section_name).bss = folded_equal<hashvec_traits_icase>(section_name, "bss"); // directives are icase
 			// add symbol entry to symtable
 			if (symtable.has(section_name))
 				throw symbol_redeclaration("Section already exsits");
-			symtable[section_name] = Symbol{ section_name, sections[section].counter };
+			symtable.emplace(section_name, (uint32_t)sections[section_name].index, sections[section].counter);
 		}
 		void onLabel(parsed_t& data) override {
 			if (symtable.has(data.values[0]))
 				throw symbol_redeclaration("Label already declared");
-			symtable[data.values[0]] = Symbol{ section, sections[section].counter };
+			symtable.emplace(data.values[0], section, sections[section].counter);
 		}
 		void onInstruction(parsed_t& data) override {
-			if (!optable.has(data.values[0]))
-				throw syntax_error("Instruction doesn't exist");
-			if (!(optable[data.values[0]].flags & E) && (data.flags & EXTENDED))
-				throw syntax_error("This instruction has fixed size");
-
-			int bytes = INSTR_SZ; // inital value for opcode
-			int op_sz = get_op_sz(data.values[0], data.flags);
-
-			auto ival = data.values.begin() + 1; // skipping instruction which is always first
-			for (int i = 1; (i <= OP_NUM) && (data.flags & ENABLE(i)); i++, ival++) {
-				bytes += 1; //op<num>_desc sz
-				flags_t mode = MODE_MASK(data.flags, i);
-
-				// error checking for improper size
-				if ((data.flags & EXTENDED) && (data.flags & REDUCED(i)))
-					throw syntax_error("You cannot use extended instruction with reduced register size");
-
-				// skipping captured reduced if it exists
-				if (data.flags & REDUCED(i))
-					ival++;
-
-				if (mode == IMMED(i) || mode == (IMMED(i) | SYMABS(i)))
-					bytes += op_sz;
-				else if (mode == (IMMED(i) | SYMREL(i)) || mode == (IMMED(i) | SYMADR(i)))
-					bytes += DWORD_SZ;
-				else if (mode == REGIND16(i)) {
-					int shift_sz = utils::bitsize(utils::sctoi(*ival)) > WORD_SZ ? DWORD_SZ : WORD_SZ;
-					if (shift_sz == WORD_SZ)
-						SET_MODE(data.flags, i, REGIND8(i));
-					bytes += shift_sz;
-				}
-				else if (mode == (REGIND16(i) | SYMABS(i))) {
-					ival++;
-					int shift_sz = constants.has(*ival) ? (utils::bitsize(utils::sctoi(*ival)) > WORD_SZ ? DWORD_SZ : WORD_SZ) : DWORD_SZ;
-					if (shift_sz == WORD_SZ)
-						SET_MODE(data.flags, i, REGIND8(i));
-					bytes += shift_sz;
-				}
-				else if (mode == MEM(i))
-					bytes += DWORD_SZ;
-
+			instruction_t& instr = data.instr = decode(data, names);
+
+			// displacements that fit in a byte are shortened, for symbols only known constants qualify
+			for (int i = 0; i < instr.count; i++) {
+				operand_t& op = instr.operands[i];
+				if (op.mode != operand_t::REGIND16)
+					continue;
+				if (op.symbol == operand_t::NONE ? utils::bitsize(op.value) <= WORD_SZ * 8 :
+					constants.has(names[op.name]) && utils::bitsize(constants[names[op.name]].value) <= WORD_SZ * 8)
+					op.mode = operand_t::REGIND8;
 			}
 
-			sections[section].counter += bytes;
+			sections[section].counter += instruction_size(instr);
 		}
 		void onAlloc(parsed_t& data) override {
 			int multiplier = data.values[0] == "byte" ? WORD_SZ : DWORD_SZ;
-			sections[section].counter += (data.values.size() - 1) * multiplier;
+			sections[section].counter += numchar_count(data.values[1]) * multiplier;
 		}
 		void onAlign(parsed_t& data) override {
-			int num = std::stoi(data.values[0]);
+			int num = utils::stoi(data.values[0]);
 			if (!(((num & ~(num - 1)) == num) ? num : 0))
 				throw syntax_error("Align number must be power 2");
 			sections[section].counter += sections[section].counter % num;
 		}
 		void onSkip(parsed_t& data) override {
-			sections[section].counter += std::stoi(data.values[1]);
+			Section& current = sections[section];
+			int count = utils::stoi(data.values[1]);
+			if (current.keeps_run(count))
+				current.reserve_run(count, data.values.size() > 2 ? utils::stoi(data.values[2]) : 0);
+			else
+				current.counter += count;
 		}
 		void onEqu(parsed_t& data) override {
 			constants[data.values[0]].value = utils::sctoi(data.values[1]);
 		}
+		void onIncbin(parsed_t& data) override {
+			context.included = true;
+			sections[section].counter += incbin_range(data, context.input_path).length;
+		}
+		void onAscii(parsed_t& data) override {
+			sections[section].counter += string_length(data.values[1], std::tolower(data.values[0].back()) == 'z');
+		}
 	};
 
 	class SecondPass : public Pass {
 		using reloc_t = Relocation::reloc_t;
+	public:
+		using Pass::Pass;
+	private:
 
 		void onAlloc(parsed_t& data) override {
 			auto& stream = data.values[0] == "byte" ? sections[section].words : sections[section].dwords;
-			for (auto it = ++data.values.begin(); it != data.values.end(); ++it) {
-				stream << utils::sctoi(*it);
-			}
+			token list = data.values[1];
+			// values are converted straight into the section, list is scanned once
+			stream.generate(numchar_count(list), [list](auto&& emit) {
+				for_each_numchar(list, [&](token value) { emit(utils::sctoi(value)); });
+			});
+		}
+		void onIncbin(parsed_t& data) override {
+			incbin_t range = incbin_range(data, context.input_path);
+			source_file blob(range.path); // mapped, copied to the section in one go
+			sections[section].write((const uint8_t*)blob.view().data() + range.offset, range.length);
+		}
+		void onAscii(parsed_t& data) override {
+			token list = data.values[1];
+			bool terminated = std::tolower(data.values[0].back()) == 'z';
+			sections[section].bytes.generate(string_length(list, terminated), [&](auto&& emit) {
+				for_each_string_byte(list, terminated, emit);
+			});
 		}
 		void onReloc(parsed_t& data) override {
 			if (symtable.has(data.values[1]))
 				symtable[data.values[1]].isLocal = false;
 		}
 		void onSkip(parsed_t& data) override {
-			for (int i = 0; i < std::stoi(data.values[1]); i++)
-				sections[section].bytes << std::stoi(data.values.size() > 2 ? data.values[2] : "0");
+			Section& current = sections[section];
+			int fill = data.values.size() > 2 ? utils::stoi(data.values[2]) : 0;
+			int count = utils::stoi(data.values[1]);
+			if (current.keeps_run(count))
+				current.skip_run(count); // recorded by first pass, nothing to write
+			else
+				current.bytes.fill(fill, count);
 		}
 		void onInstruction(parsed_t& data) override {
-			uint8_t instr_desc = optable[data.values[0]].index << 3;
-			if (get_op_sz(data.values[0], data.flags) == DWORD_SZ)
-				instr_desc |= 0x4;
-
-			sections[section].bytes << instr_desc; // pushing instruction desecriptor to stream
-
-			//if((datum.flags & ENABLE(2)) && (MODE_MASK(CLEAR_SYM(datum.flags),1) == IMMED(1)))
-			//	throw syntax_error(iter->line_num, iter->line, "IMMED for dst not allowed.");
-
-			auto ival = data.values.begin() + 1; //skipping instructions
-
-			for (int i = 1; (i <= OP_NUM) && (data.flags & ENABLE(i)); i++, ival++) {
-				// process operand info
-				flags_t mode = MODE_MASK(data.flags, i);
-				uint8_t op_desc = ADDR_MASK(data.flags, i);
-				int op_sz = get_op_sz(data.values[0], data.flags);
-				// override in case of regind with movement as it doesn't care for optable
-				if (CLEAR_SYM(mode, i) == REGIND8(i))
-					op_sz = WORD_SZ;
-				else if (CLEAR_SYM(mode, i) == REGIND16(i))
-					op_sz = DWORD_SZ;
-
-				// helper capturing lambda functions for symbol resolvment
-				auto get_sym = [&data, mode, &ival](int i) -> string& {
-					if ((CLEAR_SYM(mode, i) == REGIND16(i)) || (CLEAR_SYM(mode, i) == REGIND8(i)))
-						return *(ival + 1);
-					else return *ival;
-				};
-				auto symbol_resolver = [op_desc, op_sz](string& symbol, const string& section, reloc_t reloc) {
-					auto make_relocation = [&]() {
-						// counter + 1 is dirty fix because symbol resolvment happens before opdesc is pushed to stream and that can never be subject to relocation as it is always known
-						relocations.push_back(Relocation{ section, sections[section].counter + 1, symtable[symbol].index, reloc });
-						symbol = std::to_string(std::pow(2, op_sz * 8) - 1);
-					};
-
-					if (constants.has(symbol)) {
-						if (reloc != reloc_t::R_386_16)
-							throw syntax_error("You cannot use relative relocation on absolute data");
-						symbol = std::to_string(constants[symbol].value);
-					} else if (symtable.has(symbol) && symtable[symbol].offset != 0xFFFF) {
-						if (reloc == reloc_t::R_386_16) {
-							string memdump = sections[symtable[symbol].section].memdump();
-							int off = 2 * symtable[symbol].offset;
-							// if mem has not yet been populated we cannot access it - must add relocation
-							if (memdump.size() < off + op_sz * 2)
-								return make_relocation();
-#ifdef LITTLE_ENDIAN
-							int num = 0;
-							for (int i = op_sz * 2 - 2; i >= 0; i -= 2)
-								num += std::stoi(memdump.substr(off + i, 2), nullptr, 16) << (i * 4);
-							symbol = std::to_string(num);
-#else
-							symbol = std::to_string(std::stoi(memdump.substr(off, op_sz * 2), nullptr, 16));
-#endif	
-						} else if (reloc == reloc_t::R_386_PC16) {
-							symbol = std::to_string((uint16_t)symtable[symbol].offset - (uint16_t)sections[section].counter);
-						}
-					} else { // not in symtable
-						symtable[symbol] = Symbol{ "RELOC", 0xFFFF , false };
-						make_relocation();
-					}
-				};
-
-				// call appropriate symbol resolver relocator
-				if (mode & SYMABS(i)) {
-					symbol_resolver(get_sym(i), section, reloc_t::R_386_16);
-				} else if (mode & SYMREL(i)) {
-					symbol_resolver(get_sym(i), section, reloc_t::R_386_PC16);
-				} else if (mode & SYMADR(i)) { // TODO: this has different implementation
-					symbol_resolver(get_sym(i), section, reloc_t::R_386_PC16);
-				}
-
-				// symbol resolvment is finished, clear unneeded flags
-				mode = CLEAR_SYM(mode, i);
+			encode(data.instr, sections[section], [this](const operand_t& op, int op_sz, uint offset) {
+				return resolve(op, op_sz, offset);
+			});
+		}
 
-				if (mode == REGDIR(i) || mode == REGIND(i) || mode == REGIND16(i) || mode == REGIND8(i)) {
-					op_desc |= GET_REG(*ival) << 1;
-					if ((data.flags & REDUCED(i)) && (*++ival == "h")) {
-						op_desc |= 0x1;
-					}
-				}
-				sections[section].bytes << op_desc;  // pushing operator desecriptor to stream
-
-				if (mode == IMMED(i)) {
-					if (utils::bitsize(utils::sctoi(*ival)) > 8 * op_sz)
-						throw syntax_error("Overflow");
-					sections[section].get_stream(op_sz) << utils::sctoi(*ival);
-				} else if (mode == REGIND16(i)) {
-					sections[section].dwords << utils::sctoi(*++ival);
-				} else if (mode == REGIND8(i)) {
-					sections[section].words << utils::sctoi(*++ival);
-				} else if (mode == MEM(i)) {
-					sections[section].dwords << utils::sctoi(*ival);
-				} 
+		// constant or symtable entry an interned name refers to, names are hashed once per pass
+		struct binding_t {
+			int constant = -1;
+			int symbol = -1;
+		};
+		vector<binding_t> bindings;
+		binding_t& bind(uint32_t name) {
+			if (bindings.size() <= name)
+				bindings.resize(names.size());
+			binding_t& binding = bindings[name];
+			if (binding.constant < 0 && binding.symbol < 0) {
+				token symbol = names[name];
+				if (constants.has(symbol))
+					binding.constant = constants[symbol].index;
+				else if (symtable.has(symbol))
+					binding.symbol = symtable[symbol].index;
+			}
+			return binding;
+		}
 
+		// value of symbol operand written at offset, adds relocation if it cannot be known yet
+		uint16_t resolve(const operand_t& op, int op_sz, uint offset) {
+			binding_t& binding = bind(op.name);
+			reloc_t reloc = op.symbol == operand_t::ABS ? reloc_t::R_386_16 : reloc_t::R_386_PC16; // TODO: SYMADR has different implementation
+			auto make_relocation = [&]() -> uint16_t {
+				relocations.add(Relocation{ section, offset, (uint)binding.symbol, reloc });
+				return (1 << op_sz * 8) - 1;
+			};
+
+			if (binding.constant >= 0) {
+				if (reloc != reloc_t::R_386_16)
+					throw syntax_error("You cannot use relative relocation on absolute data");
+				return constants[binding.constant].value;
+			} else if (binding.symbol >= 0 && symtable[binding.symbol].offset != 0xFFFF) {
+				const Symbol& symbol = symtable[binding.symbol];
+				if (reloc == reloc_t::R_386_PC16)
+					return (uint16_t)symbol.offset - (uint16_t)(offset - 1); // relative to operand descriptor
+
+				auto value = sections[symbol.section].peek(symbol.offset, op_sz);
+				// if mem has not yet been populated we cannot access it - must add relocation
+				return value ? *value : make_relocation();
+			} else if (binding.symbol < 0) { // not in symtable
+				symtable[names[op.name]] = Symbol{ Symbol::EXTERN, 0xFFFF, false };
+				binding.symbol = symtable[names[op.name]].index;
 			}
+			return make_relocation();
 		}
 	};
 
-	string input_path, output_path;
+	string Assembler::build(const source_file& source) {
+		if (!cache)
+			return run(source);
+		string key = cache_key(source.view(), engine, format);
+		if (auto object = cache->lookup(key)) {
+			stats.cache_hits++;
+			*log << "object " << key << " taken from cache\n";
+			return std::move(*object);
+		}
+		string object = run(source);
+		// whether included files are used is only known once the source is parsed
+		if (!included) {
+			stats.cache_misses++;
+			cache->insert(key, object);
+		}
+		return object;
+	}
+
+	string Assembler::run(const source_file& source) {
+		{
+			// tokens of both passes are views into the source
+			program recording(memory);
+			recording.reserve(std::count(source.view().begin(), source.view().end(), '\n') + 1);
+
+			FirstPass{ *this }.process(source, recording);
+			stats.lines = recording.size();
+
+			// sizes counted by first pass are final, storage is allocated once and filled in place
+			for (auto& section : sections)
+				section.allocate();
+
+			SecondPass{ *this }.process(recording);
+			stats.arena_bytes = memory.size();
+		}
+		// interned names are views into the source, they go away with it and the recording
+		names = interner{ memory };
+		memory.release();
 
-	void init(const string& input, const string& output) {
-		input_path = input;
-		output_path = output;
-	
-		symtable = hashvec<Symbol>{};
-		sections = hashvec<Section>{};
-		relocations = vector<Relocation>{};
-		constants = hashvec<Constant>{};
+		for (auto& section : sections)
+			if (section.counter != section.size())
+				throw std::runtime_error(utils::string_format("Section %s has %u bytes in second pass but %u were counted in first pass",
+					section.key.c_str(), section.counter, section.size()));
+
+		// text form is rendered once, the log and a text output file share it
+		string text = render_text(sections, symtable, relocations);
+		log->write(text.data(), text.size());
+		*log << constants;
+
+		if (format == object_format::BINARY)
+			return render_binary(sections, symtable, relocations);
+		return text;
 	}
 
+	// single instance behind the init/assemble interface, its tables are reachable under the old global names
+	Assembler assembler;
+	hashvec<Symbol>& symtable = assembler.symtable;
+	hashvec<Section>& sections = assembler.sections;
+	relocation_table& relocations = assembler.relocations;
+	hashvec<Constant>& constants = assembler.constants;
+	stats_t& stats = assembler.stats;
+
+	void init(const string& input, const string& output, parser_engine parser = parser_engine::LEXER, object_format output_format = object_format::TEXT) {
+		assembler.reset(input, output, parser, output_format);
+	}
 	void assemble() {
+		assembler.assemble();
+	}
 
-		FirstPass{}.process(input_path);
+	parser_engine parse_engine(const string& name) {
+		if (name == "lexer")
+			return parser_engine::LEXER;
+		if (name == "regex")
+			return parser_engine::REGEX;
+		throw std::runtime_error("Unknown parser engine " + name);
+	}
+	object_format parse_format(const string& name) {
+		if (name == "text")
+			return object_format::TEXT;
+		if (name == "bin")
+			return object_format::BINARY;
+		throw std::runtime_error("Unknown object format " + name);
+	}
 
-		// restart section counters
-		for (auto& section : sections)
-			section.counter = 0;
+	// rewrites an object file of either format in the requested one
+	void convert(const string& input, const string& output, object_format output_format) {
+		source_file file(input);
+		object_t object = load_object(file.view());
+		write_file(output, render_object(output_format, object.sections, object.symtable, object.relocations));
+	}
 
-		SecondPass{}.process(input_path);
+	// object file written for input in batch mode, next to the source unless outdir is given
+	string batch_output(const string& input, const string& outdir) {
+		size_t slash = input.rfind('/');
+		string name = slash == string::npos ? input : input.substr(slash + 1);
+		size_t dot = name.rfind('.');
+		if (dot != string::npos && dot > 0)
+			name.resize(dot);
+		string dir = !outdir.empty() ? outdir : slash == string::npos ? "" : input.substr(0, slash);
+		return dir.empty() ? name + ".o" : dir + (dir.back() == '/' ? "" : "/") + name + ".o";
+	}
 
-		streams::log << relocations;
-		streams::log << sections;
-		streams::log << symtable;
-		streams::log << constants;
+	// creates dir and every missing parent, like mkdir -p
+	static void make_directories(const string& dir) {
+		for (size_t slash = dir.find('/', 1); ; slash = dir.find('/', slash + 1)) {
+			string prefix = dir.substr(0, slash);
+			if (::mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+				throw std::runtime_error("Cannot create output directory " + prefix + ": " + std::strerror(errno));
+			if (slash == string::npos)
+				break;
+		}
+		struct stat info;
+		if (::stat(dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode))
+			throw std::runtime_error("Output directory " + dir + " is not a directory");
+	}
 
-		std::ofstream fout(output_path);
-		fout << relocations;
-		fout << sections;
-		fout << symtable;
+	// Assembles every input with its own Assembler on a pool of jobs threads. Logs, and diagnostics
+	// prefixed with the file name, are written in input order whatever the thread count.
+	// Sources are read ahead and objects written through file_io, so workers only assemble. Cache
+	// entries are read and written through file_io too, the cache is trimmed by the caller.
+	// Returns the number of files that failed, counters of all runs are added to total.
+	size_t assemble_batch(const vector<string>& inputs, const string& outdir, size_t jobs, parser_engine engine, object_format format,
+		std::ostream& log, std::ostream& error, stats_t& total, const object_cache* cache = nullptr) {
+		vector<string> outputs;
+		std::unordered_map<string, size_t> owners;
+		for (const string& input : inputs) {
+			outputs.push_back(batch_output(input, outdir));
+			if (!owners.emplace(outputs.back(), outputs.size() - 1).second)
+				throw std::runtime_error("Sources " + inputs[owners[outputs.back()]] + " and " + input + " would both be written to " + outputs.back());
+		}
+		if (!outdir.empty())
+			make_directories(outdir);
+
+		struct result_t {
+			std::ostringstream log;
+			string error;
+			stats_t stats;
+			bool finished = false;
+		};
+		vector<result_t> results(inputs.size());
+		std::mutex state_lock;
+		std::condition_variable finished;
+		size_t failed = 0, next_read = 0;
+
+		// destroyed first, so no callback outlives the state above
+		std::unique_ptr<file_io> io = file_io::create();
+		thread_pool pool(std::min(jobs, inputs.size()));
+
+		std::function<void(size_t)> read;
+		// runs on workers and on the I/O thread, only records the result, printing is left to the caller
+		auto finish = [&](size_t i, const string& message) {
+			std::lock_guard<std::mutex> guard(state_lock);
+			if (!message.empty())
+				results[i].error = inputs[i] + ": " + message + '\n';
+			results[i].finished = true;
+			// a file is done, the next one can be read ahead
+			if (next_read < inputs.size())
+				read(next_read++);
+			finished.notify_one();
+		};
+		auto assemble = [&](size_t i, string contents, const string& key) {
+			result_t& result = results[i];
+			string object;
+			bool included = false;
+			try {
+				Assembler assembler(inputs[i], outputs[i], engine, format);
+				assembler.log = &result.log;
+				source_file source(source_file::in_memory, std::move(contents));
+				object = assembler.build(source);
+				result.stats = assembler.stats;
+				included = assembler.included;
+			} catch (std::exception& err) {
+				return finish(i, err.what());
+			}
+			if (!key.empty() && !included) {
+				// published once completely written, a failed write only costs a later miss
+				result.stats.cache_misses = 1;
+				string temporary = cache->temporary();
+				io->write(temporary, object, [cache, temporary, key](const string& message) {
+					if (message.empty())
+						cache->publish(temporary, key);
+					else
+						::unlink(temporary.c_str());
+				});
+			}
+			io->write(outputs[i], std::move(object), [&finish, i](const string& message) { finish(i, message); });
+		};
+		// looks the source up in the cache before assembling it
+		auto prepare = [&](size_t i, string contents) {
+			string key = cache ? Assembler::cache_key(contents, engine, format) : "";
+			if (key.empty())
+				return assemble(i, std::move(contents), key);
+			io->read(cache->entry(key), [&, i, key, contents = std::move(contents)](string object, const string& message) mutable {
+				if (!message.empty()) // not cached yet
+					return pool.submit([&assemble, i, key, contents = std::move(contents)]() mutable { assemble(i, std::move(contents), key); });
+				cache->touch(key);
+				results[i].stats.cache_hits = 1;
+				results[i].log << "object " << key << " taken from cache\n";
+				io->write(outputs[i], std::move(object), [&finish, i](const string& message) { finish(i, message); });
+			});
+		};
+		read = [&](size_t i) {
+			io->read(inputs[i], [&, i](string contents, const string& message) {
+				if (!message.empty())
+					return finish(i, message);
+				pool.submit([&prepare, i, contents = std::move(contents)]() mutable { prepare(i, std::move(contents)); });
+			});
+		};
+
+		// enough sources are in flight to keep every worker busy while the next ones load
+		std::unique_lock<std::mutex> guard(state_lock);
+		for (size_t ahead = std::min(2 * pool.size(), inputs.size()); next_read < ahead;)
+			read(next_read++);
+		// finished files are printed as soon as every file before them is, nothing else touches them by then
+		for (size_t printed = 0; printed < results.size(); printed++) {
+			finished.wait(guard, [&] { return results[printed].finished; });
+			guard.unlock();
+			result_t& next = results[printed];
+			log << next.log.str();
+			error << next.error;
+			failed += !next.error.empty();
+			total.lines += next.stats.lines;
+			total.arena_bytes = std::max(total.arena_bytes, next.stats.arena_bytes);
+			total.cache_hits += next.stats.cache_hits;
+			total.cache_misses += next.stats.cache_misses;
+			next.log = std::ostringstream{};
+			guard.lock();
+		}
+		return failed;
 	}
 
 
+	// Server answering assemble requests on a Unix socket, jobs at a time. Static tables are built once
+	// for the process and every worker keeps one Assembler, so requests reuse its table storage.
+	std::unique_ptr<remote::server> assembly_server(const string& path, size_t jobs, const object_cache* cache = nullptr) {
+		return std::make_unique<remote::server>(path, jobs, [cache](remote::request_t& request, remote::response_t& response) {
+			if (request.command == "stop")
+				return false;
+			if (request.command != "assemble")
+				throw std::runtime_error("Unknown request " + request.command);
+
+			thread_local Assembler worker;
+			std::ostringstream log;
+			worker.reset(request.input, request.output, parse_engine(request.parser), parse_format(request.format));
+			worker.log = &log;
+			worker.cache = cache;
+			try {
+				if (request.has_source) {
+					source_file source(source_file::in_memory, std::move(request.source));
+					write_file(worker.output_path, worker.build(source));
+				} else {
+					worker.assemble();
+				}
+				response.lines = worker.stats.lines;
+			} catch (std::exception& err) {
+				response.status = 1;
+				response.diagnostics.push_back(err.what());
+			}
+			worker.log = &std::cout;
+			response.log = log.str();
+			response.cache = cache;
+			response.cache_hits = worker.stats.cache_hits;
+			response.cache_misses = worker.stats.cache_misses;
+			return true;
+		});
+	}
+	void serve(const string& path, size_t jobs, const object_cache* cache = nullptr) {
+		assembly_server(path, jobs, cache)->run();
+	}
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,78 @@
+#ifndef __ASM_ARENA_H__
+#define __ASM_ARENA_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace ASM {
+	// Bump allocator for data that lives as long as one assembly run. Memory is taken from the
+	// heap in large blocks and is given back all at once by release(), single objects are never freed.
+	class arena {
+		static constexpr size_t BLOCK_SZ = 64 * 1024;
+
+		std::vector<std::unique_ptr<std::byte[]>> blocks;
+		std::byte* current = nullptr;
+		size_t left = 0;
+		size_t reserved = 0;
+	public:
+		arena() = default;
+		arena(const arena&) = delete;
+		arena& operator=(const arena&) = delete;
+
+		void* allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+			size_t padding = -(uintptr_t)current & (align - 1);
+			if (padding + size > left) {
+				size_t block_sz = std::max(BLOCK_SZ, size + align);
+				blocks.emplace_back(new std::byte[block_sz]);
+				current = blocks.back().get();
+				left = block_sz;
+				reserved += block_sz;
+				padding = -(uintptr_t)current & (align - 1);
+			}
+			void* ptr = current + padding;
+			current += padding + size;
+			left -= padding + size;
+			return ptr;
+		}
+		// frees every block, nothing allocated from the arena may be used afterwards
+		void release() {
+			blocks.clear();
+			current = nullptr;
+			left = 0;
+			reserved = 0;
+		}
+		// bytes taken from the heap
+		size_t size() const {
+			return reserved;
+		}
+	};
+
+	// standard allocator over an arena, deallocation is a no-op until the arena is released
+	template <typename T>
+	struct arena_allocator {
+		using value_type = T;
+		arena* memory;
+
+		arena_allocator(arena& memory) : memory(&memory) {}
+		template <typename U>
+		arena_allocator(const arena_allocator<U>& rhs) : memory(rhs.memory) {}
+
+		T* allocate(size_t n) {
+			return static_cast<T*>(memory->allocate(n * sizeof(T), alignof(T)));
+		}
+		void deallocate(T*, size_t) {}
+
+		template <typename U>
+		bool operator==(const arena_allocator<U>& rhs) const {
+			return memory == rhs.memory;
+		}
+		template <typename U>
+		bool operator!=(const arena_allocator<U>& rhs) const {
+			return memory != rhs.memory;
+		}
+	};
+}
+
+#endif
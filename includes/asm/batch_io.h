@@ -0,0 +1,472 @@
+#ifndef __ASM_BATCH_IO_H__
+#define __ASM_BATCH_IO_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "asm/thread_pool.h"
+
+namespace ASM {
+	// Asynchronous whole file reads and writes for batch mode. Requests return at once and
+	// completions are reported through callbacks on an I/O thread, so callers never wait on files.
+	// Callbacks should be short, they hold up other completions.
+	class file_io {
+	public:
+		using read_done = std::function<void(std::string contents, const std::string& error)>;
+		using write_done = std::function<void(const std::string& error)>;
+
+		virtual ~file_io() = default;
+		virtual void read(const std::string& path, read_done done) = 0;
+		virtual void write(const std::string& path, std::string contents, write_done done) = 0;
+		virtual const char* name() const = 0;
+
+		// io_uring when the kernel allows it, otherwise a pool of threads doing pread/pwrite
+		static std::unique_ptr<file_io> create(size_t threads = 4);
+	protected:
+		static std::string describe(int error) {
+			return std::system_category().message(error);
+		}
+	};
+
+	// blocking calls on a few dedicated threads
+	class pread_io : public file_io {
+		thread_pool pool;
+	public:
+		explicit pread_io(size_t threads = 4) : pool(threads) {}
+		~pread_io() {
+			pool.wait();
+		}
+
+		void read(const std::string& path, read_done done) override {
+			pool.submit([path, done] {
+				int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+				if (fd < 0)
+					return done({}, "Cannot open source file " + path + ": " + describe(errno));
+				struct stat info;
+				bool stream = ::fstat(fd, &info) != 0 || !S_ISREG(info.st_mode); // pipes and terminals cannot pread
+				std::string contents(stream ? 0 : info.st_size, '\0');
+				size_t length = 0;
+				for (;;) {
+					if (length == contents.size())
+						contents.resize(std::max<size_t>(contents.size() * 2, 4096)); // file grew or is not regular
+					ssize_t count = stream ? ::read(fd, &contents[length], contents.size() - length) :
+						::pread(fd, &contents[length], contents.size() - length, length);
+					if (count < 0 && errno == EINTR)
+						continue;
+					if (count < 0) {
+						int error = errno;
+						::close(fd);
+						return done({}, "Cannot read source file " + path + ": " + describe(error));
+					}
+					if (count == 0)
+						break;
+					length += count;
+				}
+				::close(fd);
+				contents.resize(length);
+				done(std::move(contents), {});
+			});
+		}
+		void write(const std::string& path, std::string contents, write_done done) override {
+			pool.submit([path, contents = std::move(contents), done] {
+				int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+				if (fd < 0)
+					return done("Cannot open output file " + path + ": " + describe(errno));
+				for (size_t written = 0; written < contents.size();) {
+					ssize_t count = ::pwrite(fd, contents.data() + written, contents.size() - written, written);
+					if (count < 0 && errno == EINTR)
+						continue;
+					if (count < 0) {
+						int error = errno;
+						::close(fd);
+						return done("Cannot write output file " + path + ": " + describe(error));
+					}
+					written += count;
+				}
+				::close(fd);
+				done({});
+			});
+		}
+		const char* name() const override {
+			return "pread";
+		}
+	};
+
+	// Single io_uring driven by one thread through raw syscalls. Every step of a request goes
+	// through the ring, open, stat of reads, the transfers and close, so the thread only ever waits
+	// in io_uring_enter. An eventfd read in the ring wakes it for new requests.
+	class uring_io : public file_io {
+		struct op_t {
+			enum stage_t { OPENING, STATING, TRANSFERRING, CLOSING };
+			bool writing;
+			std::string path;
+			std::string data;
+			read_done on_read;
+			write_done on_write;
+			stage_t stage = OPENING;
+			size_t done = 0;
+			int fd = -1;
+			bool stream = false; // not a regular file, read from the current position until it ends
+			iovec iov{};
+			struct statx info{};
+			std::string error; // kept while the descriptor is closed
+		};
+		static constexpr uint64_t WAKE = 0; // user data of the eventfd read, ops use their address
+		static constexpr unsigned ENTRIES = 64;
+
+		int ring = -1;
+		int wake_fd = -1;
+		uint64_t wake_value = 0;
+		iovec wake_iov;
+		void* sq_ring = MAP_FAILED;
+		void* cq_ring = MAP_FAILED;
+		io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+		size_t sq_ring_size = 0, cq_ring_size = 0, sqes_size = 0;
+		unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+		unsigned *cq_head, *cq_tail, *cq_mask;
+		io_uring_cqe* cqes;
+		unsigned sq_entries = 0;
+		unsigned to_submit = 0;
+		unsigned in_ring = 0; // submitted ops without completion, eventfd read excluded
+
+		std::mutex lock;
+		std::condition_variable changed; // wakes the thread once the ring is broken and the eventfd is not read
+		std::deque<std::unique_ptr<op_t>> requests;
+		bool stopping = false;
+		std::thread worker;
+		std::unordered_set<op_t*> active; // started and not finished
+		std::vector<std::unique_ptr<op_t>> abandoned; // failed while the kernel may still use their buffers
+
+		template <typename T>
+		static T* field(void* base, unsigned offset) {
+			return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+		}
+		void release() {
+			if (sqes != MAP_FAILED) ::munmap(sqes, sqes_size);
+			if (cq_ring != MAP_FAILED && cq_ring != sq_ring) ::munmap(cq_ring, cq_ring_size);
+			if (sq_ring != MAP_FAILED) ::munmap(sq_ring, sq_ring_size);
+			if (wake_fd >= 0) ::close(wake_fd);
+			if (ring >= 0) ::close(ring);
+		}
+		// open, statx and close came with the same kernel, older rings leave batch I/O to pread_io
+		void probe() {
+			alignas(io_uring_probe) char buffer[sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op)] = {};
+			io_uring_probe* supported = reinterpret_cast<io_uring_probe*>(buffer);
+			if (::syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, supported, 256) < 0)
+				throw std::system_error(errno, std::system_category(), "io_uring probe");
+			for (uint8_t opcode : { IORING_OP_READV, IORING_OP_WRITEV, IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_CLOSE })
+				if (opcode > supported->last_op || !(supported->ops[opcode].flags & IO_URING_OP_SUPPORTED))
+					throw std::system_error(ENOSYS, std::system_category(), "io_uring opcode " + std::to_string(opcode));
+		}
+		void push(const io_uring_sqe& entry) {
+			unsigned tail = *sq_tail;
+			unsigned index = tail & *sq_mask;
+			sqes[index] = entry;
+			sq_array[index] = index;
+			__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+			to_submit++;
+		}
+		static io_uring_sqe entry(uint8_t opcode, int fd, uint64_t user_data) {
+			io_uring_sqe sqe{};
+			sqe.opcode = opcode;
+			sqe.fd = fd;
+			sqe.user_data = user_data;
+			return sqe;
+		}
+		void arm_wake() {
+			wake_iov = { &wake_value, sizeof(wake_value) };
+			io_uring_sqe sqe = entry(IORING_OP_READV, wake_fd, WAKE);
+			sqe.addr = reinterpret_cast<uint64_t>(&wake_iov);
+			sqe.len = 1;
+			push(sqe);
+		}
+		// queues the next step of op, each op has at most one entry in the ring
+		void queue(const io_uring_sqe& sqe) {
+			push(sqe);
+			in_ring++;
+		}
+		void open_file(op_t* op) {
+			io_uring_sqe sqe = entry(IORING_OP_OPENAT, AT_FDCWD, reinterpret_cast<uint64_t>(op));
+			sqe.addr = reinterpret_cast<uint64_t>(op->path.c_str());
+			sqe.open_flags = op->writing ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+			sqe.len = 0644;
+			op->stage = op_t::OPENING;
+			queue(sqe);
+		}
+		void stat_file(op_t* op) {
+			io_uring_sqe sqe = entry(IORING_OP_STATX, op->fd, reinterpret_cast<uint64_t>(op));
+			sqe.addr = reinterpret_cast<uint64_t>("");
+			sqe.statx_flags = AT_EMPTY_PATH;
+			sqe.len = STATX_TYPE | STATX_SIZE;
+			sqe.off = reinterpret_cast<uint64_t>(&op->info);
+			op->stage = op_t::STATING;
+			queue(sqe);
+		}
+		void transfer(op_t* op) {
+			// reads fill the buffer and grow it until the file ends, like pread_io
+			if (!op->writing && op->done == op->data.size())
+				op->data.resize(std::max<size_t>(op->data.size() * 2, 4096));
+			op->iov = { &op->data[op->done], op->data.size() - op->done };
+			io_uring_sqe sqe = entry(op->writing ? IORING_OP_WRITEV : IORING_OP_READV, op->fd, reinterpret_cast<uint64_t>(op));
+			sqe.addr = reinterpret_cast<uint64_t>(&op->iov);
+			sqe.len = 1;
+			sqe.off = op->stream ? (uint64_t)-1 : op->done; // -1 is the current position of pipes and terminals
+			op->stage = op_t::TRANSFERRING;
+			queue(sqe);
+		}
+		// closes the descriptor through the ring before reporting error or success
+		void close_file(op_t* op, std::string error) {
+			op->error = std::move(error);
+			if (op->fd < 0)
+				return finish(op, op->error);
+			io_uring_sqe sqe = entry(IORING_OP_CLOSE, op->fd, reinterpret_cast<uint64_t>(op));
+			op->fd = -1;
+			op->stage = op_t::CLOSING;
+			queue(sqe);
+		}
+		void finish(op_t* op, const std::string& error) {
+			std::unique_ptr<op_t> owned(op);
+			active.erase(op);
+			report(op, error);
+		}
+		void report(op_t* op, const std::string& error) {
+			if (op->fd >= 0)
+				::close(op->fd);
+			op->fd = -1;
+			if (op->writing)
+				op->on_write(error);
+			else if (error.empty())
+				op->on_read(std::move(op->data), error);
+			else
+				op->on_read({}, error);
+		}
+		void start(std::unique_ptr<op_t> request) {
+			op_t* op = request.release();
+			active.insert(op);
+			open_file(op);
+		}
+		void complete(op_t* op, int result) {
+			in_ring--;
+			if (result == -EINTR || result == -EAGAIN) {
+				if (op->stage == op_t::TRANSFERRING)
+					return transfer(op);
+				if (op->stage == op_t::OPENING)
+					return open_file(op);
+				if (op->stage == op_t::STATING)
+					return stat_file(op);
+			}
+			switch (op->stage) {
+			case op_t::OPENING:
+				if (result < 0)
+					return finish(op, string_error(op, "open", -result));
+				op->fd = result;
+				if (op->writing)
+					return op->data.empty() ? close_file(op, {}) : transfer(op);
+				return stat_file(op);
+			case op_t::STATING:
+				if (result < 0)
+					return close_file(op, string_error(op, "read", -result));
+				op->stream = !S_ISREG(op->info.stx_mode);
+				op->data.resize(op->stream ? 0 : op->info.stx_size);
+				return transfer(op);
+			case op_t::TRANSFERRING:
+				if (result < 0)
+					return close_file(op, string_error(op, op->writing ? "write" : "read", -result));
+				if (result == 0 && op->writing)
+					return close_file(op, string_error(op, "write", EIO));
+				if (result == 0) { // end of file, it may have shrunk or grown since the stat
+					op->data.resize(op->done);
+					return close_file(op, {});
+				}
+				op->done += result;
+				if (op->writing && op->done == op->data.size())
+					return close_file(op, {});
+				return transfer(op);
+			case op_t::CLOSING:
+				// a write that only fails when closed is not complete
+				if (result < 0 && op->error.empty() && op->writing)
+					op->error = string_error(op, "write", -result);
+				return finish(op, op->error);
+			}
+		}
+		static std::string string_error(const op_t* op, const char* what, int error) {
+			return std::string("Cannot ") + what + (op->writing ? " output file " : " source file ") + op->path + ": " + describe(error);
+		}
+
+		void run() {
+			arm_wake();
+			std::deque<std::unique_ptr<op_t>> waiting;
+			bool draining = false;
+			for (;;) {
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					while (!requests.empty()) {
+						waiting.push_back(std::move(requests.front()));
+						requests.pop_front();
+					}
+					draining = stopping;
+				}
+				// every op needs at most one entry, one is left for the eventfd read
+				while (!waiting.empty() && in_ring + to_submit + 1 < sq_entries) {
+					start(std::move(waiting.front()));
+					waiting.pop_front();
+				}
+				if (draining && waiting.empty() && in_ring == 0)
+					return;
+
+				int entered = ::syscall(__NR_io_uring_enter, ring, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+				if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+					return fail(waiting, errno);
+				if (entered > 0)
+					to_submit -= std::min<unsigned>(entered, to_submit);
+
+				unsigned head = *cq_head;
+				unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+				for (; head != tail; head++) {
+					const io_uring_cqe& cqe = cqes[head & *cq_mask];
+					uint64_t user_data = cqe.user_data;
+					int result = cqe.res;
+					__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+					if (user_data == WAKE) {
+						if (!draining)
+							arm_wake();
+					} else {
+						complete(reinterpret_cast<op_t*>(user_data), result);
+					}
+				}
+			}
+		}
+		// the ring cannot be entered any more: every started, waiting and later op fails with the reason
+		void fail(std::deque<std::unique_ptr<op_t>>& waiting, int error) {
+			for (op_t* op : active) {
+				report(op, string_error(op, op->writing ? "write" : "read", error));
+				abandoned.emplace_back(op); // freed with the ring
+			}
+			active.clear();
+			for (auto& op : waiting) {
+				std::string message = string_error(op.get(), op->writing ? "write" : "read", error);
+				finish(op.release(), message);
+			}
+			std::unique_lock<std::mutex> guard(lock);
+			for (;;) {
+				while (!requests.empty()) {
+					std::unique_ptr<op_t> op = std::move(requests.front());
+					requests.pop_front();
+					guard.unlock();
+					std::string message = string_error(op.get(), op->writing ? "write" : "read", error);
+					finish(op.release(), message);
+					guard.lock();
+				}
+				if (stopping)
+					return;
+				changed.wait(guard);
+			}
+		}
+		void enqueue(std::unique_ptr<op_t> op) {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				requests.push_back(std::move(op));
+			}
+			changed.notify_one();
+			uint64_t one = 1;
+			while (::write(wake_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+		}
+	public:
+		uring_io() {
+			io_uring_params params{};
+			ring = ::syscall(__NR_io_uring_setup, ENTRIES, &params);
+			if (ring < 0)
+				throw std::system_error(errno, std::system_category(), "io_uring_setup");
+			try {
+				probe();
+			} catch (std::system_error&) {
+				release();
+				throw;
+			}
+			wake_fd = ::eventfd(0, EFD_CLOEXEC);
+			if (wake_fd < 0) {
+				release();
+				throw std::system_error(errno, std::system_category(), "eventfd");
+			}
+
+			sq_entries = params.sq_entries;
+			sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			if (params.features & IORING_FEAT_SINGLE_MMAP)
+				sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+			sq_ring = ::mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+			cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? sq_ring :
+				::mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+			sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+			sqes = (io_uring_sqe*)::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+			if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+				int error = errno;
+				release();
+				throw std::system_error(error, std::system_category(), "io_uring mmap");
+			}
+
+			sq_head = field<unsigned>(sq_ring, params.sq_off.head);
+			sq_tail = field<unsigned>(sq_ring, params.sq_off.tail);
+			sq_mask = field<unsigned>(sq_ring, params.sq_off.ring_mask);
+			sq_array = field<unsigned>(sq_ring, params.sq_off.array);
+			cq_head = field<unsigned>(cq_ring, params.cq_off.head);
+			cq_tail = field<unsigned>(cq_ring, params.cq_off.tail);
+			cq_mask = field<unsigned>(cq_ring, params.cq_off.ring_mask);
+			cqes = field<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+
+			worker = std::thread(&uring_io::run, this);
+		}
+		uring_io(const uring_io&) = delete;
+		uring_io& operator=(const uring_io&) = delete;
+		// waits for every request to complete
+		~uring_io() {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				stopping = true;
+			}
+			changed.notify_one();
+			uint64_t one = 1;
+			while (::write(wake_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+			worker.join();
+			release();
+		}
+
+		void read(const std::string& path, read_done done) override {
+			enqueue(std::unique_ptr<op_t>(new op_t{ false, path, {}, std::move(done), {} }));
+		}
+		void write(const std::string& path, std::string contents, write_done done) override {
+			enqueue(std::unique_ptr<op_t>(new op_t{ true, path, std::move(contents), {}, std::move(done) }));
+		}
+		const char* name() const override {
+			return "io_uring";
+		}
+	};
+
+	std::unique_ptr<file_io> file_io::create(size_t threads) {
+		try {
+			return std::make_unique<uring_io>();
+		} catch (std::system_error&) {
+			return std::make_unique<pread_io>(threads); // no io_uring: old kernel, disabled or filtered
+		}
+	}
+}
+
+#endif
@@ -14,5 +14,12 @@ namespace ASM {
 	struct symbol_redeclaration : public syntax_error{
 		symbol_redeclaration(const std::string& msg = "") : syntax_error("Symbol redecleration not allowed. " + msg) {}
 	};
+	// error of a single source line, the message says which one so callers only have to report it
+	class line_error : public std::exception {
+		std::string m_msg;
+	public:
+		line_error(const std::string& msg) : m_msg(msg) {}
+		virtual const char * what() const noexcept { return m_msg.c_str(); }
+	};
 }
 #endif
\ No newline at end of file
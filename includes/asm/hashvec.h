@@ -2,52 +2,155 @@
 #define __ASM_HASHVEC_H__
 
 #include <vector>
-#include <unordered_map>
 #include <string>
+#include <string_view>
+#include <cstdint>
+#include <algorithm>
 
 namespace ASM {
 	struct hashvec_traits {
 		static constexpr bool icase = false;
+		static char fold(char c) {
+			return c;
+		}
 	};
 
 	struct hashvec_traits_icase : hashvec_traits {
 		static constexpr bool icase = true;
+		static char fold(char c) {
+			return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+		}
 	};
 
+	// whether names are the same once folded by traits
+	template <typename traits>
+	bool folded_equal(std::string_view a, std::string_view b) {
+		if (a.size() != b.size())
+			return false;
+		for (size_t i = 0; i < a.size(); i++)
+			if (traits::fold(a[i]) != traits::fold(b[i]))
+				return false;
+		return true;
+	}
+
+	// Vector of values that can also be looked up by name. Entries keep their insertion index,
+	// names are stored once in the entries while the lookup table is a flat open addressing
+	// array of (hash, index) slots probed linearly.
 	template <typename T, typename traits = hashvec_traits>
 	class hashvec {
 		struct mapped_type : public T {
-			const std::string key;
-			const int index;
-			mapped_type(std::string key, int index, const T& value) : T(value), key(key), index(index) {}
+			std::string key;
+			int index;
+			// value is constructed in place from args
+			template <typename... Args>
+			mapped_type(std::string_view key, int index, Args&&... args) : T{ std::forward<Args>(args)... }, key(key), index(index) {}
 			mapped_type& operator=(const T& value) {
 				T::operator=(value);
 				return *this;
 			}
+			mapped_type& operator=(T&& value) {
+				T::operator=(std::move(value));
+				return *this;
+			}
 		};
 		struct init_type {
-			const std::string key;
+			std::string_view key;
 			T value;
 		};
-		std::unordered_map<std::string, int> map;
+		struct slot_t {
+			uint32_t hash;
+			int32_t index = -1; // -1 marks empty slot
+		};
+		std::vector<slot_t> slots;
 		std::vector<mapped_type> vec;
+
+		// FNV-1a over folded characters, no lowercased copy of the key is made
+		static uint32_t hash(std::string_view key) {
+			uint32_t h = 2166136261u;
+			for (char c : key)
+				h = (h ^ (unsigned char)traits::fold(c)) * 16777619u;
+			return h;
+		}
+		static bool equal(std::string_view a, std::string_view b) {
+			return folded_equal<traits>(a, b);
+		}
+		// position of the slot holding the key, or of the empty slot where it belongs
+		size_t probe(std::string_view key, uint32_t h) const {
+			size_t mask = slots.size() - 1;
+			for (size_t i = h & mask;; i = (i + 1) & mask) {
+				const slot_t& slot = slots[i];
+				if (slot.index < 0 || (slot.hash == h && equal(vec[slot.index].key, key)))
+					return i;
+			}
+		}
+		// keeps load factor at most 1/2
+		void grow() {
+			rehash(std::max<size_t>(16, slots.size() * 2));
+		}
+		void rehash(size_t capacity) {
+			std::vector<slot_t> old(capacity);
+			old.swap(slots);
+			size_t mask = slots.size() - 1;
+			for (auto& slot : old) {
+				if (slot.index < 0) continue;
+				size_t i = slot.hash & mask;
+				while (slots[i].index >= 0)
+					i = (i + 1) & mask;
+				slots[i] = slot;
+			}
+		}
+		int find(std::string_view key) const {
+			return slots.empty() ? -1 : slots[probe(key, hash(key))].index;
+		}
 	public:
 		hashvec() = default;
 		hashvec(std::initializer_list<init_type> list) {
+			reserve(list.size());
 			for (auto& elem : list) {
 				put(elem.key, elem.value);
 			}
 		}
-		void put(const std::string& key, const T& value) {
-			vec.push_back(mapped_type(key, vec.size(), value));
-			map[key] = vec.size() - 1;
+		hashvec(hashvec&&) = default;
+		hashvec& operator=(hashvec&&) = default;
+
+		void reserve(size_t count) {
+			vec.reserve(count);
+			size_t capacity = 16;
+			while (capacity < 2 * count)
+				capacity *= 2;
+			if (capacity > slots.size())
+				rehash(capacity);
+		}
+
+		// drops all entries but keeps storage for reuse
+		void clear() {
+			vec.clear();
+			std::fill(slots.begin(), slots.end(), slot_t{});
 		}
 
-		bool has(const std::string& key) {
-			if constexpr (traits::icase)
-				return map.count(utils::tolower(key));
-			else
-				return map.count(key);
+		// single probe lookup, value is constructed in place from args when key is missing
+		template <typename... Args>
+		mapped_type& emplace(std::string_view key, Args&&... args) {
+			if (2 * (vec.size() + 1) > slots.size())
+				grow();
+			uint32_t h = hash(key);
+			slot_t& slot = slots[probe(key, h)];
+			if (slot.index < 0) {
+				slot = slot_t{ h, (int32_t)vec.size() };
+				vec.emplace_back(key, vec.size(), std::forward<Args>(args)...);
+			}
+			return vec[slot.index];
+		}
+		// adds the entry unless key is already present
+		void put(std::string_view key, const T& value) {
+			emplace(key, value);
+		}
+		void put(std::string_view key, T&& value) {
+			emplace(key, std::move(value));
+		}
+
+		bool has(std::string_view key) const {
+			return find(key) >= 0;
 		}
 
 		auto begin() const {
@@ -68,14 +171,18 @@ namespace ASM {
 		mapped_type& operator[](unsigned int index) {
 			return vec[index];
 		}
-		mapped_type& operator[](const std::string& key) {
-			if (!has(key))
-				put(key, T{});
-
-			if constexpr (traits::icase)
-				return vec[map[utils::tolower(key)]];
-			else
-				return vec[map[key]];
+		const mapped_type& at(unsigned int index) const {
+			return vec.at(index);
+		}
+		mapped_type& operator[](std::string_view key) {
+			return emplace(key);
+		}
+		// lookup that never inserts nor rehashes, safe on tables shared between threads
+		const mapped_type& at(std::string_view key) const {
+			int index = find(key);
+			if (index < 0)
+				throw std::out_of_range("Key not present in hashvec");
+			return vec[index];
 		}
 
 		template <typename U>
@@ -83,4 +190,4 @@ namespace ASM {
 	};
 }
 
-#endif
\ No newline at end of file
+#endif
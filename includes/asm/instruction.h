@@ -0,0 +1,155 @@
+#ifndef __ASM_INSTRUCTION_H__
+#define __ASM_INSTRUCTION_H__
+
+#include "asm/types.h"
+#include "asm/parser.h"
+#include "asm/interner.h"
+#include "asm/hashvec.h"
+
+namespace ASM {
+	const hashvec<Instruction, hashvec_traits_icase> optable = {
+		{"nop", Nop},
+		{"halt", Nop},
+		{"xchg", E},
+		{"int"},
+		{"mov", Z | N | E},
+		{"add", Z | O | C | N | E},
+		{"sub", Z | O | C | N | E},
+		{"mul", Z | N | E},
+		{"div", Z | N | E},
+		{"cmp", Z | O | C | N | E},
+		{"not", Z | N | E},
+		{"and", Z | N | E},
+		{"or", Z | N | E},
+		{"xor", Z | N | E},
+		{"test", Z | N | E},
+		{"shl", Z | C | N | E},
+		{"shr", Z | C | N | E},
+		{"push"},
+		{"pop"},
+		{"jmp"},
+		{"jeq"},
+		{"jne"},
+		{"jgt"},
+		{"call"},
+		{"ret"},
+		{"iret"}
+	};
+
+	// helper function to fetch proper operand size
+	static int get_op_sz(token instruction, const flags_t& flags) {
+		if (!optable.has(instruction))
+			throw std::runtime_error("Instruction not in optable");
+		if (optable.at(instruction).flags & Nop) // no operands
+			return 0;
+		else if (optable.at(instruction).flags & E) // variable operands
+			return flags & EXTENDED ? DWORD_SZ : WORD_SZ;
+		else
+			return DWORD_SZ;
+	}
+
+	// number of bytes operand value takes after its descriptor
+	static int operand_size(const instruction_t& instr, const operand_t& op) {
+		switch (op.mode) {
+		case operand_t::IMMED: return op.symbol == operand_t::REL || op.symbol == operand_t::ADR ? DWORD_SZ : instr.size;
+		case operand_t::REGIND8: return WORD_SZ;
+		case operand_t::REGIND16: return DWORD_SZ;
+		case operand_t::MEM: return DWORD_SZ;
+		default: return 0;
+		}
+	}
+
+	static int instruction_size(const instruction_t& instr) {
+		int bytes = INSTR_SZ;
+		for (int i = 0; i < instr.count; i++)
+			bytes += 1 + operand_size(instr, instr.operands[i]); // op<num>_desc sz + value
+		return bytes;
+	}
+
+	// numbers in operands, as sctoi but reported as syntax errors
+	static uint16_t operand_number(token value) {
+		try {
+			return utils::sctoi(value);
+		}
+		catch (std::logic_error&) {
+			throw syntax_error("Invalid number " + string(value));
+		}
+	}
+
+	// turns parsed instruction tokens into typed instruction, symbol names are interned
+	static instruction_t decode(const parsed_t& data, interner& names) {
+		if (!optable.has(data.values[0]))
+			throw syntax_error("Instruction doesn't exist");
+		if (!(optable.at(data.values[0]).flags & E) && (data.flags & EXTENDED))
+			throw syntax_error("This instruction has fixed size");
+
+		instruction_t instr;
+		instr.opcode = optable.at(data.values[0]).index;
+		instr.size = get_op_sz(data.values[0], data.flags);
+
+		auto ival = data.values.begin() + 1; // skipping instruction which is always first
+		for (int i = 1; (i <= OP_NUM) && (data.flags & ENABLE(i)); i++) {
+			operand_t& op = instr.operands[instr.count++];
+			flags_t mode = MODE_MASK(data.flags, i);
+			op.mode = operand_t::mode_t(ADDR_MASK(data.flags, i) >> 5);
+			if (mode & SYMABS(i)) op.symbol = operand_t::ABS;
+			else if (mode & SYMREL(i)) op.symbol = operand_t::REL;
+			else if (mode & SYMADR(i)) op.symbol = operand_t::ADR;
+
+			// error checking for improper size
+			if ((data.flags & EXTENDED) && (data.flags & REDUCED(i)))
+				throw syntax_error("You cannot use extended instruction with reduced register size");
+
+			token value = *ival++;
+			if (op.mode == operand_t::REGDIR || op.mode == operand_t::REGIND || op.mode == operand_t::REGIND16) {
+				op.reg = GET_REG(value);
+				if (data.flags & REDUCED(i)) {
+					op.high = *ival == "h" || *ival == "H";
+					ival++;
+				}
+				if (op.mode == operand_t::REGIND16) // displacement follows register
+					value = *ival++;
+				else continue;
+			}
+
+			if (op.symbol != operand_t::NONE)
+				op.name = names.intern(value);
+			else
+				op.value = operand_number(value);
+		}
+		return instr;
+	}
+
+	// Writes machine code of the instruction to the section. Symbols are resolved by calling
+	// resolve(operand, operand_size, offset) where offset is the section offset of their value.
+	// The instruction is assembled in a local buffer and written to the section at once.
+	template <typename Resolver>
+	static void encode(const instruction_t& instr, Section& section, Resolver&& resolve) {
+		uint8_t code[INSTR_SZ + OP_NUM * (1 + DWORD_SZ)];
+		uint length = 0;
+
+		uint8_t instr_desc = instr.opcode << 3;
+		if (instr.size == DWORD_SZ)
+			instr_desc |= 0x4;
+		code[length++] = instr_desc;
+
+		for (int i = 0; i < instr.count; i++) {
+			const operand_t& op = instr.operands[i];
+			int op_sz = operand_size(instr, op);
+
+			uint8_t op_desc = op.mode << 5;
+			if (op.mode == operand_t::REGDIR || op.mode == operand_t::REGIND || op.mode == operand_t::REGIND16 || op.mode == operand_t::REGIND8)
+				op_desc |= op.reg << 1 | op.high;
+			code[length++] = op_desc;
+
+			uint16_t value = op.symbol != operand_t::NONE ? resolve(op, op_sz, section.counter + length) : op.value;
+			if (op.mode == operand_t::IMMED && utils::bitsize(value) > 8 * op_sz)
+				throw syntax_error("Overflow");
+			Section::store(code + length, value, op_sz);
+			length += op_sz;
+		}
+		section.write(code, length);
+	}
+}
+
+#endif
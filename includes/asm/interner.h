@@ -0,0 +1,37 @@
+#ifndef __ASM_INTERNER_H__
+#define __ASM_INTERNER_H__
+
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "asm/arena.h"
+
+namespace ASM {
+	// Assigns dense integer ids to names. Names are kept as views, so whatever they point into
+	// (the source mapping) has to outlive the interner. Its tables are allocated from the arena.
+	class interner {
+		using entry_t = std::pair<const std::string_view, uint32_t>;
+		std::unordered_map<std::string_view, uint32_t, std::hash<std::string_view>, std::equal_to<std::string_view>, arena_allocator<entry_t>> ids;
+		std::vector<std::string_view, arena_allocator<std::string_view>> names;
+	public:
+		interner(arena& memory) : ids(arena_allocator<entry_t>(memory)), names(memory) {}
+
+		uint32_t intern(std::string_view name) {
+			auto found = ids.find(name);
+			if (found != ids.end())
+				return found->second;
+			ids.emplace(name, (uint32_t)names.size());
+			names.push_back(name);
+			return names.size() - 1;
+		}
+		std::string_view operator[](uint32_t id) const {
+			return names[id];
+		}
+		size_t size() const {
+			return names.size();
+		}
+	};
+}
+
+#endif
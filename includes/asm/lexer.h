@@ -0,0 +1,445 @@
+#ifndef __ASM_LEXER_H__
+#define __ASM_LEXER_H__
+
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cctype>
+
+#include "asm/parser.h"
+
+namespace ASM {
+	using string = std::string;
+	template <typename T> using vector = std::vector<T>;
+
+	// Single pass recognizer for the grammar described by parsers[]. It produces exactly the same
+	// flags and values as the regex engine (including its quirks, like unanchored immediates and
+	// section names), so both can be used interchangeably by source_iterator.
+	namespace lexer {
+		enum : uint8_t { SPACE = 0x1, DIGIT = 0x2, WORD = 0x4 };
+
+		// character classes matching \s, \d and \w of the regex grammar
+		static const std::array<uint8_t, 256> char_class = [] {
+			std::array<uint8_t, 256> table{};
+			for (int c : {' ', '\t', '\n', '\v', '\f', '\r'})
+				table[c] |= SPACE;
+			for (int c = '0'; c <= '9'; c++)
+				table[c] |= DIGIT | WORD;
+			for (int c = 'a'; c <= 'z'; c++)
+				table[c] |= WORD, table[c - 'a' + 'A'] |= WORD;
+			table['_'] |= WORD;
+			return table;
+		}();
+
+		inline bool is(char c, uint8_t cls) {
+			return char_class[(unsigned char)c] & cls;
+		}
+
+		struct cursor {
+			const char* pos;
+			const char* end;
+
+			cursor(token str) : pos(str.data()), end(str.data() + str.size()) {}
+			cursor(const char* pos, const char* end) : pos(pos), end(end) {}
+
+			char peek(size_t n = 0) const { return pos + n < end ? pos[n] : '\0'; }
+			cursor& skip_space() {
+				while (pos < end && is(*pos, SPACE)) pos++;
+				return *this;
+			}
+			bool accept(char c) {
+				if (peek() != c) return false;
+				pos++;
+				return true;
+			}
+			// case insensitive keyword prefix
+			bool accept(const char* keyword) {
+				const char* p = pos;
+				for (; *keyword; keyword++, p++)
+					if (p == end || std::tolower((unsigned char)*p) != *keyword)
+						return false;
+				pos = p;
+				return true;
+			}
+			// consumes the longest run of characters from the class, returns it
+			token span(uint8_t cls) {
+				const char* begin = pos;
+				while (pos < end && is(*pos, cls)) pos++;
+				return token(begin, pos - begin);
+			}
+			token rest() const { return token(pos, end - pos); }
+			token since(const char* begin) const { return token(begin, pos - begin); }
+		};
+
+		// \d+ | '\w' | '\\\w' at the cursor, the forms allowed in NUMCHAR_REGEXES
+		static bool numchar(cursor& cur, token& value) {
+			cursor c = cur;
+			if (is(c.peek(), DIGIT)) {
+				value = c.span(DIGIT);
+			} else if (c.peek() == '\'' && is(c.peek(1), WORD) && c.peek(2) == '\'') {
+				value = token(c.pos + 1, 1);
+				c.pos += 3;
+			} else if (c.peek() == '\'' && c.peek(1) == '\\' && is(c.peek(2), WORD) && c.peek(3) == '\'') {
+				value = token(c.pos + 1, 2);
+				c.pos += 4;
+			} else return false;
+			cur = c;
+			return true;
+		}
+
+		// leftmost occurrence of 'x' pattern in the line, as in unanchored NUMCHAR_REGEXES
+		static bool find_char(token line, bool escaped, token& value, token& suffix) {
+			size_t len = escaped ? 4 : 3;
+			for (size_t i = 0; i + len <= line.size(); i++) {
+				if (line[i] != '\'' || line[i + len - 1] != '\'' || !is(line[i + len - 2], WORD) || (escaped && line[i + 1] != '\\'))
+					continue;
+				value = line.substr(i + 1, len - 2);
+				suffix = line.substr(i + len);
+				return true;
+			}
+			return false;
+		}
+
+		// leftmost case insensitive occurrence of .<name>, as in unanchored SECTION regexes
+		static bool find_section(token line, const char* name, token_list& values) {
+			for (size_t i = 0; i < line.size(); i++) {
+				cursor c(line.data() + i, line.data() + line.size());
+				if (c.accept('.') && c.accept(name)) {
+					values.push_back(c.since(line.data() + i + 1));
+					values.push_back(c.rest());
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// register name following the REGISTER_REGEXES alternatives
+		static bool reg(cursor& cur, token& value) {
+			cursor c = cur;
+			c.skip_space();
+			if ((c.peek() == 'r' || c.peek() == 'R') && c.peek(1) >= '0' && c.peek(1) <= '7') {
+				value = token(c.pos + 1, 1);
+				cur.pos = c.pos + 2;
+				return true;
+			}
+			for (const char* name : { "ax", "sp", "bp", "pc" }) {
+				const char* begin = c.pos;
+				if (c.accept(name)) {
+					value = c.since(begin);
+					cur = c;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		static bool operand(token line, int op, flags_t& flags, token_list& values) {
+			cursor cur(line);
+			cur.skip_space();
+			token value;
+
+			// register based modes with optional half selector and displacement
+			cursor c = cur;
+			bool indirect = c.accept('[');
+			if (reg(c, value) && (!indirect || c.accept(']'))) {
+				values.push_back(value);
+				flags_t mode = indirect ? REGIND(op) : REGDIR(op);
+				if (c.peek() == 'l' || c.peek() == 'h' || c.peek() == 'L' || c.peek() == 'H') {
+					values.push_back(token(c.pos, 1));
+					flags |= REDUCED(op);
+					c.pos++;
+				}
+				cursor disp = c;
+				disp.skip_space();
+				if (disp.accept('[')) {
+					token shift = disp.span(WORD);
+					if (!shift.empty() && disp.accept(']')) {
+						values.push_back(shift);
+						mode = std::all_of(shift.begin(), shift.end(), [](char c) { return is(c, DIGIT); }) ? REGIND16(op) : REGIND16(op) | SYMABS(op);
+						c = disp;
+					}
+				}
+				values.push_back(c.rest());
+				flags |= mode | SUCCESS;
+				return true;
+			}
+
+			c = cur;
+			if (c.accept('*') && is(c.peek(), DIGIT)) {
+				values.push_back(c.span(DIGIT));
+				values.push_back(c.rest());
+				flags |= MEM(op) | SUCCESS;
+				return true;
+			}
+
+			// immediates are searched for anywhere in the operand, every form is tried
+			bool found = false;
+			auto digit = std::find_if(line.begin(), line.end(), [](char c) { return is(c, DIGIT); });
+			if (digit != line.end()) {
+				cursor d(digit, line.data() + line.size());
+				values.push_back(d.span(DIGIT));
+				values.push_back(d.rest());
+				found = true;
+			}
+			for (bool escaped : { false, true }) {
+				token suffix;
+				if (find_char(line, escaped, value, suffix)) {
+					values.push_back(value);
+					values.push_back(suffix);
+					found = true;
+				}
+			}
+			if (found) {
+				flags |= IMMED(op) | SUCCESS;
+				return true;
+			}
+
+			flags_t mode = IMMED(op) | SYMABS(op);
+			c = cur;
+			if (c.accept('$')) mode = IMMED(op) | SYMREL(op);
+			else if (c.accept('&')) mode = IMMED(op) | SYMADR(op);
+			value = c.span(WORD);
+			if (value.empty())
+				return false;
+			values.push_back(value);
+			values.push_back(c.rest());
+			flags |= mode | SUCCESS;
+			return true;
+		}
+
+		static bool label(token line, parsed_t& data) {
+			cursor cur(line);
+			token name = cur.skip_space().span(WORD);
+			if (name.empty() || !cur.accept(':'))
+				return false;
+			data.values = { name, cur.rest() };
+			return true;
+		}
+
+		static bool alloc(token line, parsed_t& data) {
+			cursor cur(line);
+			const char* begin = cur.skip_space().pos + 1;
+			if (!cur.accept('.') || !(cur.accept("byte") || cur.accept("word") || cur.accept("dword")))
+				return false;
+			token value;
+			data.values = { cur.since(begin) };
+			const char* first = cur.skip_space().pos;
+			if (!numchar(cur, value))
+				return false;
+			// list is kept as a single token, elements are scanned again only when needed
+			while (true) {
+				cursor next = cur;
+				if (!next.skip_space().accept(',') || !numchar(next.skip_space(), value))
+					break;
+				cur = next;
+			}
+			data.values.push_back(cur.since(first));
+			data.values.push_back(cur.rest());
+			return true;
+		}
+
+		// "..." with the escapes allowed by STRING_REGEX
+		static bool string_literal(cursor& cur) {
+			cursor c = cur;
+			if (!c.accept('"'))
+				return false;
+			while (c.pos < c.end && *c.pos != '"') {
+				if (*c.pos == '\\') {
+					if (c.pos + 1 == c.end || token("ntr0\\\"'").find(std::tolower((unsigned char)c.pos[1])) == token::npos)
+						return false;
+					c.pos++;
+				}
+				c.pos++;
+			}
+			if (!c.accept('"'))
+				return false;
+			cur = c;
+			return true;
+		}
+
+		// .ascii/.asciz "str"[, "str"...], list of literals is kept as a single token
+		static bool ascii(token line, parsed_t& data) {
+			cursor cur(line);
+			const char* begin = cur.skip_space().pos + 1;
+			if (!cur.accept('.') || !(cur.accept("ascii") || cur.accept("asciz")))
+				return false;
+			data.values = { cur.since(begin) };
+			const char* first = cur.skip_space().pos;
+			if (!string_literal(cur))
+				return false;
+			while (true) {
+				cursor next = cur;
+				if (!next.skip_space().accept(',') || !string_literal(next.skip_space()))
+					break;
+				cur = next;
+			}
+			data.values.push_back(cur.since(first));
+			data.values.push_back(cur.rest());
+			return true;
+		}
+
+		// .incbin "file"[, offset[, length]], missing numbers are kept as empty tokens
+		static bool incbin(token line, parsed_t& data) {
+			cursor cur(line);
+			if (!cur.skip_space().accept('.') || !cur.accept("incbin") || !cur.skip_space().accept('"'))
+				return false;
+			const char* path = cur.pos;
+			while (cur.pos < cur.end && *cur.pos != '"')
+				cur.pos++;
+			data.values = { cur.since(path), token(), token() };
+			if (!cur.accept('"'))
+				return false;
+			for (size_t i = 1; i < 3; i++) {
+				cursor next = cur;
+				if (!next.skip_space().accept(',') || !is(next.skip_space().peek(), DIGIT))
+					break;
+				data.values[i] = next.span(DIGIT);
+				cur = next;
+			}
+			data.values.push_back(cur.rest());
+			return true;
+		}
+
+		// .align and .skip share grammar: <keyword> num[, num]
+		template <const char* keyword>
+		static bool repeat(token line, parsed_t& data) {
+			cursor cur(line);
+			const char* begin = cur.skip_space().pos + 1;
+			if (!cur.accept('.') || !cur.accept(keyword))
+				return false;
+			data.values = { cur.since(begin), cur.skip_space().span(DIGIT) };
+			if (data.values.back().empty())
+				return false;
+			cursor next = cur;
+			if (next.skip_space().accept(',') && is(next.skip_space().peek(), DIGIT)) {
+				data.values.push_back(next.span(DIGIT));
+				cur = next;
+			}
+			data.values.push_back(cur.rest());
+			return true;
+		}
+		static constexpr char ALIGN_KEYWORD[] = "align";
+		static constexpr char SKIP_KEYWORD[] = "skip";
+
+		static bool section(token line, parsed_t& data) {
+			cursor cur(line);
+			if (cur.skip_space().accept('.') && cur.accept("section") && cur.skip_space().accept('"') && cur.accept('.')) {
+				token name = cur.span(WORD);
+				if (!name.empty() && cur.accept('"'))
+					data.values = { name, cur.rest() };
+			}
+			bool found = !data.values.empty();
+			for (const char* name : { "data", "text", "bss" })
+				found |= find_section(line, name, data.values);
+			return found;
+		}
+
+		static bool reloc(token line, parsed_t& data) {
+			cursor cur(line);
+			const char* begin = cur.skip_space().pos + 1;
+			if (!cur.accept('.') || !(cur.accept("global") || cur.accept("extern") || cur.accept("globl")))
+				return false;
+			data.values = { cur.since(begin) };
+			const char* symbols = cur.skip_space().pos;
+			while (cur.pos < cur.end && (is(*cur.pos, WORD) || *cur.pos == ','))
+				cur.pos++;
+			if (symbols == cur.pos)
+				return false;
+			data.values.push_back(cur.since(symbols));
+			data.values.push_back(cur.rest());
+			return true;
+		}
+
+		static bool equ(token line, parsed_t& data) {
+			cursor cur(line);
+			if (!cur.skip_space().accept('.') || !cur.accept("equ"))
+				return false;
+			token name = cur.skip_space().span(WORD);
+			if (name.empty() || !cur.accept(','))
+				return false;
+			token value = cur.skip_space().span(DIGIT);
+			if (value.empty())
+				return false;
+			data.values = { name, value, cur.rest() };
+			return true;
+		}
+
+		static const char* const MNEMONICS[] = {
+			"halt", "xchg", "int", "mov", "add", "sub", "mul", "div", "cmp", "not", "and", "or", "xor",
+			"test", "shl", "shr", "push", "pop", "jmp", "jeq", "jne", "jgt", "call", "ret", "iret"
+		};
+
+		static bool instruction(token line, parsed_t& data) {
+			cursor cur(line);
+			const char* begin = cur.skip_space().pos;
+			if (std::none_of(std::begin(MNEMONICS), std::end(MNEMONICS), [&cur](const char* name) { return cur.accept(name); }))
+				return false;
+			data.values = { cur.since(begin) };
+			if (cur.peek() == 'w' || cur.peek() == 'W') {
+				data.flags |= EXTENDED;
+				cur.pos++;
+			}
+
+			token rest = cur.rest();
+			token_list values;
+			if (operand(rest, 1, data.flags, values)) {
+				rest = values.back();
+				values.pop_back();
+			}
+			cursor comma(rest);
+			if (comma.skip_space().accept(',')) {
+				rest = comma.rest();
+				if (operand(rest, 2, data.flags, values)) {
+					rest = values.back();
+					values.pop_back();
+				}
+			}
+			data.values.insert(data.values.end(), values.begin(), values.end());
+			data.values.push_back(rest);
+			return true;
+		}
+
+		static bool end(token line, parsed_t& data) {
+			cursor cur(line);
+			if (!cur.skip_space().accept('.') || !cur.accept("end"))
+				return false;
+			data.values = { cur.rest() };
+			return true;
+		}
+
+		// recognizers in the same order as parsers[]
+		static const std::pair<flags_t, bool (*)(token, parsed_t&)> recognizers[] = {
+			{LABEL, label},
+			{ALLOC, alloc},
+			{ASCII, ascii},
+			{INCBIN, incbin},
+			{ALIGN, repeat<ALIGN_KEYWORD>},
+			{SKIP, repeat<SKIP_KEYWORD>},
+			{SECTION, section},
+			{RELOC, reloc},
+			{EQU, equ},
+			{INSTRUCTION, instruction},
+			{END, end}
+		};
+
+		// splits line into parsed data, returns part of the line that was not recognized
+		static token lex(token line, vector<parsed_t>& data) {
+			token rest = line;
+			for (auto& recognizer : recognizers) {
+				parsed_t parsed{ 0, {} };
+				if (!recognizer.second(rest, parsed))
+					continue;
+				parsed.flags |= recognizer.first | SUCCESS;
+				rest = parsed.values.back();
+				parsed.values.pop_back();
+				data.push_back(parsed);
+				if (!(parsed.flags & LABEL))
+					break;
+			}
+			return rest;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,488 @@
+#ifndef __ASM_OBJECT_H__
+#define __ASM_OBJECT_H__
+
+#include <charconv>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string_view>
+#include <unordered_map>
+
+#include "asm/types.h"
+#include "asm/hashvec.h"
+
+namespace ASM {
+	enum class object_format { TEXT, BINARY };
+
+	// Binary object file. Every part is reached through offsets from the start of the file and
+	// all fields are little endian 32 bit words, so a mapped file is used in place:
+	//   header | sections | symbols | relocations grouped by section | runs grouped by section | strings | section data
+	// Section data holds only the bytes outside of runs, each run is a record of where the repeated byte goes.
+	namespace object {
+		constexpr char MAGIC[4] = { '\x7F', 'A', 'S', 'M' };
+		constexpr uint16_t VERSION = 2;
+
+		struct header_t {
+			char magic[4];
+			uint16_t version;
+			uint16_t header_size;
+			uint32_t size;	// whole file
+			uint32_t section_count, sections;
+			uint32_t symbol_count, symbols;
+			uint32_t relocation_count, relocations;
+			uint32_t run_count, runs;
+			uint32_t strings_size, strings;
+		};
+		struct section_t {
+			// RELOC_DELTA: relocation offsets are distances from the previous relocation of the section
+			enum : uint32_t { BSS = 1, NOBITS = 2, RELOC_DELTA = 4 };
+			uint32_t name;	// offset in string table
+			uint32_t flags;
+			uint32_t size;	// including runs
+			uint32_t data;	// nobits sections have none
+			uint32_t stored;	// bytes at data, size less the run lengths
+			uint32_t relocation_count, relocations; // index of the first one in relocation table
+			uint32_t run_count, runs; // index of the first one in run table
+		};
+		struct symbol_t {
+			enum : uint32_t { GLOBAL = 1 };
+			uint32_t name;
+			uint32_t section; // index in section table or Symbol::EXTERN
+			uint32_t offset;
+			uint32_t flags;
+		};
+		struct relocation_t {
+			uint32_t offset;	// from the start of the section, or the previous relocation when delta encoded
+			uint32_t symbol; // index in symbol table
+			uint32_t type;	// Relocation::reloc_t
+		};
+		struct run_t {
+			uint32_t offset;	// from the start of the section, counting earlier runs
+			uint32_t length;
+			uint32_t value;	// repeated byte
+		};
+
+		static_assert(sizeof(header_t) == 52 && sizeof(section_t) == 36 && sizeof(symbol_t) == 16 && sizeof(relocation_t) == 12 && sizeof(run_t) == 12,
+			"object file structures must not be padded");
+
+		// contiguous array of records inside of the file
+		template <typename T>
+		struct table {
+			const T* first = nullptr;
+			uint32_t count = 0;
+
+			const T* begin() const { return first; }
+			const T* end() const { return first + count; }
+			uint32_t size() const { return count; }
+			const T& operator[](uint32_t index) const { return first[index]; }
+		};
+
+		// read only view of a binary object, checks bounds once and then hands out pointers into the file
+		class view {
+			const uint8_t* file;
+			size_t length;
+
+			static void check(bool condition) {
+				if (!condition)
+					throw std::runtime_error("Malformed binary object file");
+			}
+			template <typename T>
+			table<T> at(uint32_t offset, uint32_t count) const {
+				check(offset % alignof(T) == 0 && offset <= length && count <= (length - offset) / sizeof(T));
+				return { reinterpret_cast<const T*>(file + offset), count };
+			}
+		public:
+			view(const void* file, size_t length) : file(static_cast<const uint8_t*>(file)), length(length) {
+				check(length >= sizeof(header_t) && reinterpret_cast<uintptr_t>(file) % alignof(header_t) == 0);
+				const header_t& head = header();
+				check(std::memcmp(head.magic, MAGIC, sizeof(MAGIC)) == 0);
+				if (head.version != VERSION)
+					throw std::runtime_error("Unsupported binary object version " + std::to_string(head.version));
+				check(head.header_size == sizeof(header_t) && head.size == length);
+				check(head.strings <= length && head.strings_size <= length - head.strings);
+				check(head.strings_size > 0 && file_bytes(head.strings)[head.strings_size - 1] == '\0');
+
+				for (const relocation_t& relocation : relocations())
+					check(relocation.symbol < head.symbol_count && relocation.type <= Relocation::R_386_16);
+				for (const section_t& section : sections()) {
+					check(section.name < head.strings_size);
+					check((section.flags & section_t::NOBITS) || (section.data <= length && section.stored <= length - section.data));
+					check(section.relocations <= head.relocation_count && section.relocation_count <= head.relocation_count - section.relocations);
+					check(section.runs <= head.run_count && section.run_count <= head.run_count - section.runs);
+					check(!(section.flags & section_t::NOBITS) || (section.stored == 0 && section.run_count == 0));
+					// runs are in order, apart and inside of the section, and with the stored bytes they make up its size
+					uint64_t end = 0, run_bytes = 0;
+					for (const run_t& run : runs(section)) {
+						check(run.offset >= end && run.length > 0 && run.value <= 0xFF);
+						end = (uint64_t)run.offset + run.length;
+						run_bytes += run.length;
+					}
+					check(end <= section.size && ((section.flags & section_t::NOBITS) || run_bytes + section.stored == section.size));
+					// relocations are in offset order and inside of the section, so they can be applied in one sweep
+					uint64_t previous = 0;
+					sweep(section, [&](uint64_t offset, const relocation_t&) {
+						check(offset >= previous && offset < section.size);
+						previous = offset;
+					});
+				}
+				for (const symbol_t& symbol : symbols())
+					check(symbol.name < head.strings_size && (symbol.section < head.section_count || symbol.section == Symbol::EXTERN));
+			}
+
+			static bool is_binary(std::string_view contents) {
+				return contents.size() >= sizeof(MAGIC) && std::memcmp(contents.data(), MAGIC, sizeof(MAGIC)) == 0;
+			}
+
+			const header_t& header() const {
+				return *reinterpret_cast<const header_t*>(file);
+			}
+			table<section_t> sections() const {
+				return at<section_t>(header().sections, header().section_count);
+			}
+			table<symbol_t> symbols() const {
+				return at<symbol_t>(header().symbols, header().symbol_count);
+			}
+			table<relocation_t> relocations() const {
+				return at<relocation_t>(header().relocations, header().relocation_count);
+			}
+			table<relocation_t> relocations(const section_t& section) const {
+				return { relocations().first + section.relocations, section.relocation_count };
+			}
+			table<run_t> runs() const {
+				return at<run_t>(header().runs, header().run_count);
+			}
+			table<run_t> runs(const section_t& section) const {
+				return { runs().first + section.runs, section.run_count };
+			}
+			// calls fn(offset, relocation) for relocations of the section in order, with delta encoding undone
+			template <typename F>
+			void sweep(const section_t& section, F&& fn) const {
+				uint64_t offset = 0;
+				for (const relocation_t& relocation : relocations(section)) {
+					offset = section.flags & section_t::RELOC_DELTA ? offset + relocation.offset : relocation.offset;
+					fn(offset, relocation);
+				}
+			}
+			std::string_view name(uint32_t offset) const {
+				return reinterpret_cast<const char*>(file_bytes(header().strings) + offset);
+			}
+			// stored bytes of the section, section.stored of them, nullptr for nobits
+			const uint8_t* data(const section_t& section) const {
+				return section.flags & section_t::NOBITS ? nullptr : file_bytes(section.data);
+			}
+			// calls bytes(pointer, length) for stored parts and run(value, length) for runs, in section order
+			template <typename Bytes, typename Run>
+			void visit(const section_t& section, Bytes&& bytes, Run&& run) const {
+				if (section.flags & section_t::NOBITS) {
+					if (section.size)
+						run((uint8_t)0, section.size);
+					return;
+				}
+				const uint8_t* stored = data(section);
+				uint32_t offset = 0;
+				for (const run_t& r : runs(section)) {
+					if (r.offset > offset)
+						bytes(stored, r.offset - offset);
+					stored += r.offset - offset;
+					run((uint8_t)r.value, r.length);
+					offset = r.offset + r.length;
+				}
+				if (offset < section.size)
+					bytes(stored, section.size - offset);
+			}
+		private:
+			const uint8_t* file_bytes(uint32_t offset) const {
+				return file + offset;
+			}
+		};
+	}
+
+	// tables of an object file, either produced by assembling or loaded from one of the formats
+	struct object_t {
+		hashvec<Section> sections;
+		hashvec<Symbol> symtable;
+		relocation_table relocations;
+	};
+
+	static string render_text(const hashvec<Section>& sections, const hashvec<Symbol>& symtable, const relocation_table& relocations) {
+		return render_text(with_sections(relocations, sections), sections, with_sections(symtable, sections));
+	}
+
+	static string render_binary(const hashvec<Section>& sections, const hashvec<Symbol>& symtable, const relocation_table& relocations) {
+		using namespace object;
+		auto align = [](uint32_t offset) { return (offset + 3) & ~3u; };
+
+		string strings(1, '\0'); // offset 0 is the empty name
+		std::unordered_map<std::string_view, uint32_t> string_offsets;
+		auto add_string = [&](const string& name) {
+			auto found = string_offsets.find(name);
+			if (found != string_offsets.end())
+				return found->second;
+			uint32_t offset = strings.size();
+			strings.append(name).push_back('\0');
+			string_offsets.emplace(name, offset);
+			return offset;
+		};
+
+		header_t head{};
+		std::memcpy(head.magic, MAGIC, sizeof(MAGIC));
+		head.version = VERSION;
+		head.header_size = sizeof(header_t);
+		head.section_count = sections.size();
+		head.sections = sizeof(header_t);
+		head.symbol_count = symtable.size();
+		head.symbols = head.sections + head.section_count * sizeof(section_t);
+		head.relocation_count = relocations.size();
+		head.relocations = head.symbols + head.symbol_count * sizeof(symbol_t);
+
+		// relocation groups are already in section and offset order, offsets are stored as deltas
+		vector<section_t> section_table;
+		vector<relocation_t> relocation_entries;
+		vector<run_t> run_entries;
+		section_table.reserve(sections.size());
+		relocation_entries.reserve(relocations.size());
+		for (const auto& section : sections) {
+			const auto& group = relocations.of(section.index);
+			bool nobits = section.nobits();
+			uint32_t flags = (section.bss ? section_t::BSS : 0) | (nobits ? section_t::NOBITS : 0) | (group.empty() ? 0 : section_t::RELOC_DELTA);
+			section_t entry{ add_string(section.key), flags, section.size(), 0, 0, (uint32_t)group.size(), (uint32_t)relocation_entries.size(), 0, (uint32_t)run_entries.size() };
+			uint previous = 0;
+			for (const Relocation& relocation : group) {
+				relocation_entries.push_back(relocation_t{ relocation.offset - previous, relocation.num, (uint32_t)relocation.type });
+				previous = relocation.offset;
+			}
+			if (!nobits) {
+				uint32_t offset = 0;
+				section.visit([&](const uint8_t*, uint length) {
+					entry.stored += length;
+					offset += length;
+				}, [&](uint8_t value, uint length) {
+					run_entries.push_back(run_t{ offset, length, value });
+					offset += length;
+				});
+				entry.run_count = run_entries.size() - entry.runs;
+			}
+			section_table.push_back(entry);
+		}
+		head.run_count = run_entries.size();
+		head.runs = head.relocations + head.relocation_count * sizeof(relocation_t);
+		vector<symbol_t> symbol_table;
+		symbol_table.reserve(symtable.size());
+		for (const auto& symbol : symtable)
+			symbol_table.push_back(symbol_t{ add_string(symbol.key), symbol.section, symbol.offset, symbol.isLocal ? 0 : symbol_t::GLOBAL });
+
+		head.strings = head.runs + head.run_count * sizeof(run_t);
+		head.strings_size = strings.size();
+		uint32_t offset = align(head.strings + head.strings_size);
+		for (section_t& section : section_table) {
+			if (section.flags & section_t::NOBITS)
+				continue;
+			section.data = offset;
+			offset = align(offset + section.stored);
+		}
+		head.size = offset;
+
+		// the whole file is put together in memory
+		string file(head.size, '\0');
+		auto put = [&file](uint32_t offset, const void* src, size_t length) {
+			if (length)
+				std::memcpy(&file[offset], src, length);
+		};
+		put(0, &head, sizeof(head));
+		put(head.sections, section_table.data(), section_table.size() * sizeof(section_t));
+		put(head.symbols, symbol_table.data(), symbol_table.size() * sizeof(symbol_t));
+		put(head.relocations, relocation_entries.data(), relocation_entries.size() * sizeof(relocation_t));
+		put(head.runs, run_entries.data(), run_entries.size() * sizeof(run_t));
+		put(head.strings, strings.data(), strings.size());
+		for (const auto& section : sections) {
+			uint32_t position = section_table[section.index].data;
+			if (section_table[section.index].flags & section_t::NOBITS)
+				continue;
+			section.visit([&](const uint8_t* bytes, uint length) {
+				put(position, bytes, length);
+				position += length;
+			}, [](uint8_t, uint) {});
+		}
+		return file;
+	}
+
+	static string render_object(object_format format, const hashvec<Section>& sections, const hashvec<Symbol>& symtable, const relocation_table& relocations) {
+		if (format == object_format::BINARY)
+			return render_binary(sections, symtable, relocations);
+		return render_text(sections, symtable, relocations);
+	}
+
+	// replaces the file with contents, written by a single call unless the system splits it
+	static void write_file(const string& path, std::string_view contents) {
+		int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			throw std::runtime_error("Cannot open output file " + path);
+		while (!contents.empty()) {
+			ssize_t written = ::write(fd, contents.data(), contents.size());
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written < 0) {
+				::close(fd);
+				throw std::runtime_error("Cannot write output file " + path);
+			}
+			contents.remove_prefix(written);
+		}
+		::close(fd);
+	}
+
+	static object_t load_binary(const object::view& file) {
+		object_t object;
+		for (const object::section_t& entry : file.sections()) {
+			auto& section = object.sections.emplace(file.name(entry.name));
+			if ((size_t)section.index != object.sections.size() - 1)
+				throw std::runtime_error("Duplicate section in binary object file");
+			section.bss = entry.flags & object::section_t::BSS;
+			if (entry.flags & object::section_t::NOBITS) {
+				if (entry.size)
+					section.reserve_run(entry.size, 0);
+				continue;
+			}
+			// same two steps as assembling: sizes and runs first, then the stored bytes in place
+			file.visit(entry, [&](const uint8_t*, uint length) { section.counter += length; },
+				[&](uint8_t value, uint length) { section.reserve_run(length, value); });
+			section.allocate();
+			file.visit(entry, [&](const uint8_t* bytes, uint length) { section.write(bytes, length); },
+				[&](uint8_t, uint length) { section.skip_run(length); });
+		}
+		for (const object::symbol_t& entry : file.symbols()) {
+			auto& symbol = object.symtable.emplace(file.name(entry.name), entry.section, entry.offset, !(entry.flags & object::symbol_t::GLOBAL));
+			if ((size_t)symbol.index != object.symtable.size() - 1)
+				throw std::runtime_error("Duplicate symbol in binary object file");
+		}
+		for (const object::section_t& entry : file.sections()) {
+			uint32_t section = &entry - file.sections().begin();
+			file.sweep(entry, [&](uint64_t offset, const object::relocation_t& relocation) {
+				object.relocations.add(Relocation{ section, (uint)offset, relocation.symbol, (Relocation::reloc_t)relocation.type });
+			});
+		}
+		return object;
+	}
+
+	// reads tables back from the text written by render_text
+	static object_t load_text(std::string_view contents) {
+		auto fail = [](std::string_view line) {
+			throw std::runtime_error("Malformed text object file at: " + string(line));
+		};
+		auto number = [&fail](std::string_view text, int base = 10) {
+			uint value = 0;
+			auto result = std::from_chars(text.data(), text.data() + text.size(), value, base);
+			if (result.ec != std::errc() || result.ptr != text.data() + text.size())
+				fail(text);
+			return value;
+		};
+		auto fields = [](std::string_view line) {
+			vector<std::string_view> fields;
+			for (size_t tab; (tab = line.find('\t')) != std::string_view::npos; line.remove_prefix(tab + 1))
+				fields.push_back(line.substr(0, tab));
+			fields.push_back(line);
+			return fields;
+		};
+
+		struct section_entry { std::string_view name; uint size; bool nobits; std::string_view bytes; };
+		struct symbol_entry { std::string_view name, section; uint offset; bool global; };
+		struct relocation_entry { std::string_view section; uint offset; uint num; Relocation::reloc_t type; };
+		vector<section_entry> section_entries;
+		vector<symbol_entry> symbol_entries;
+		vector<relocation_entry> relocation_entries;
+
+		enum { NONE, RELOCATIONS, BYTES, SYMBOLS, CONSTANTS } state = NONE;
+		std::string_view relocation_section;
+		while (!contents.empty()) {
+			size_t end = std::min(contents.find('\n'), contents.size());
+			std::string_view line = contents.substr(0, end);
+			contents.remove_prefix(std::min(end + 1, contents.size()));
+
+			if (state == BYTES) {
+				section_entries.back().bytes = line;
+				state = NONE;
+			} else if (line.substr(0, 6) == "#.ret.") {
+				relocation_section = line.substr(6);
+				state = RELOCATIONS;
+			} else if (line.substr(0, 2) == "#.") {
+				size_t open = line.find(" ("), close = line.find(')');
+				if (open == std::string_view::npos || close == std::string_view::npos || close < open)
+					fail(line);
+				bool nobits = line.substr(close + 1) == " nobits";
+				if (!nobits && close + 1 != line.size())
+					fail(line);
+				section_entries.push_back({ line.substr(2, open - 2), number(line.substr(open + 2, close - open - 2)), nobits, {} });
+				state = nobits ? NONE : BYTES;
+			} else if (line == "#tabela simbola") {
+				state = SYMBOLS;
+			} else if (line == "#tabela konstanti") {
+				state = CONSTANTS;
+			} else if (line.empty() || line[0] == '#' || state == CONSTANTS) {
+				continue; // column headers and constants, which are not part of the object
+			} else if (state == RELOCATIONS) {
+				auto row = fields(line);
+				if (row.size() != 3 || row[0].substr(0, 2) != "0x")
+					fail(line);
+				Relocation::reloc_t type = row[1] == "R_386_16" ? Relocation::R_386_16 : Relocation::R_386_PC16;
+				if (type == Relocation::R_386_PC16 && row[1] != "R_386_PC16")
+					fail(line);
+				relocation_entries.push_back({ relocation_section, number(row[0].substr(2), 16), number(row[2]), type });
+			} else if (state == SYMBOLS) {
+				auto row = fields(line);
+				if (row.size() != 5 || (row[3] != "local" && row[3] != "global"))
+					fail(line);
+				symbol_entries.push_back({ row[0], row[1], number(row[2]), row[3] == "global" });
+			} else {
+				fail(line);
+			}
+		}
+
+		object_t object;
+		for (const section_entry& entry : section_entries) {
+			auto& section = object.sections.emplace(entry.name);
+			section.bss = folded_equal<hashvec_traits_icase>(entry.name, "bss");
+			if (entry.nobits) {
+				section.reserve_run(entry.size, 0);
+				continue;
+			}
+			// same two steps as assembling: sizes and runs first, then the bytes in place
+			auto for_each_byte = [&](auto&& byte, auto&& run) {
+				std::string_view bytes = entry.bytes;
+				while (!bytes.empty()) {
+					size_t space = std::min(bytes.find(' '), bytes.size());
+					std::string_view item = bytes.substr(0, space);
+					bytes.remove_prefix(std::min(space + 1, bytes.size()));
+					if (item.empty())
+						continue;
+					size_t star = item.find('*');
+					if (star == std::string_view::npos)
+						byte(number(item, 16));
+					else
+						run(number(item.substr(0, star), 16), number(item.substr(star + 1)));
+				}
+			};
+			for_each_byte([&](uint) { section.counter++; }, [&](uint value, uint count) { section.reserve_run(count, value); });
+			if (section.counter != entry.size)
+				fail(entry.bytes);
+			section.allocate();
+			for_each_byte([&](uint value) { section.bytes << value; }, [&](uint, uint count) { section.skip_run(count); });
+		}
+		// sections without contents are not written, but symbols may still refer to them
+		for (const symbol_entry& entry : symbol_entries) {
+			uint32_t section = entry.section == "RELOC" ? Symbol::EXTERN : (uint32_t)object.sections[entry.section].index;
+			object.symtable.emplace(entry.name, section, entry.offset, !entry.global);
+		}
+		for (const relocation_entry& entry : relocation_entries)
+			object.relocations.add(Relocation{ (uint32_t)object.sections[entry.section].index, entry.offset, entry.num, entry.type });
+		return object;
+	}
+
+	// tables of an object file in either format
+	static object_t load_object(std::string_view contents) {
+		if (object::view::is_binary(contents))
+			return load_binary(object::view(contents.data(), contents.size()));
+		return load_text(contents);
+	}
+}
+
+#endif
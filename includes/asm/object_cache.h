@@ -0,0 +1,196 @@
+#ifndef __ASM_OBJECT_CACHE_H__
+#define __ASM_OBJECT_CACHE_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <link.h>
+#include <sys/stat.h>
+#include <unistd.h>
+// elf.h names its relocation types as macros, they would replace Relocation::reloc_t
+#undef R_386_16
+#undef R_386_PC16
+
+#include "asm/object.h"
+#include "asm/sha256.h"
+
+namespace ASM {
+	// Identifies the running binary, so objects cached by another build are never reused. It is the
+	// build ID the linker put in the executable, or a hash of the executable when there is none.
+	static const std::string& build_version() {
+		static const std::string version = [] {
+			std::string id;
+			dl_iterate_phdr([](dl_phdr_info* info, size_t, void* out) {
+				// first object reported is the executable itself
+				for (int i = 0; i < info->dlpi_phnum; i++) {
+					const ElfW(Phdr)& segment = info->dlpi_phdr[i];
+					if (segment.p_type != PT_NOTE)
+						continue;
+					const char* note = reinterpret_cast<const char*>(info->dlpi_addr + segment.p_vaddr);
+					for (const char* end = note + segment.p_memsz; note + sizeof(ElfW(Nhdr)) <= end;) {
+						const ElfW(Nhdr)* header = reinterpret_cast<const ElfW(Nhdr)*>(note);
+						const char* name = note + sizeof(ElfW(Nhdr));
+						const char* desc = name + ((header->n_namesz + 3) & ~3u);
+						if (header->n_type == NT_GNU_BUILD_ID && header->n_namesz == 4 && std::memcmp(name, "GNU", 4) == 0) {
+							static_cast<std::string*>(out)->assign(desc, header->n_descsz);
+							return 1;
+						}
+						note = desc + ((header->n_descsz + 3) & ~3u);
+					}
+				}
+				return 1;
+			}, &id);
+			if (!id.empty())
+				return sha256{}.update(id).hex();
+			std::ifstream self("/proc/self/exe", std::ios::in | std::ios::binary);
+			std::ostringstream contents;
+			contents << self.rdbuf();
+			return sha256{}.update(contents.str()).hex();
+		}();
+		return version;
+	}
+
+	// Objects stored on disk under a key made from everything they depend on. Entries are
+	// written to a temporary file and renamed into place, so processes sharing the directory
+	// only ever see complete entries. A hit touches the entry, trim drops the least recently
+	// used ones until the directory fits in max_bytes. It runs every trim_interval inserts and
+	// should be called once more when a run is done.
+	class object_cache {
+		static constexpr unsigned trim_interval = 64; // inserts between directory scans of a long run
+		std::string dir;
+		uint64_t max_bytes;
+		mutable std::atomic<unsigned> inserted{ 0 };
+	public:
+		object_cache(const std::string& dir, uint64_t max_bytes) : dir(dir), max_bytes(max_bytes) {
+			if (::mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+				throw std::runtime_error("Cannot create cache directory " + dir);
+		}
+
+		// SHA-256 of the build, the options and the source, sources that differ do not share an entry
+		static std::string key(std::string_view source, const std::string& options) {
+			return sha256{}.update(build_version()).update(std::string_view("\0", 1)).update(options)
+				.update(std::string_view("\0", 1)).update(source).hex();
+		}
+
+		// file holding the object of key, callers doing their own I/O read it and touch it on a hit
+		std::string entry(const std::string& key) const {
+			return dir + "/" + key + ".o";
+		}
+		// unique file in the cache directory to write an object to before it is published
+		std::string temporary() const {
+			static std::atomic<unsigned> sequence{ 0 };
+			return dir + "/.tmp." + std::to_string(::getpid()) + "." + std::to_string(sequence++) + "." +
+				std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+		}
+		// moves a completely written temporary file into place as the entry of key
+		void publish(const std::string& temporary, const std::string& key) const {
+			if (::rename(temporary.c_str(), entry(key).c_str()) != 0)
+				::unlink(temporary.c_str());
+		}
+		// marks the entry of key as most recently used
+		void touch(const std::string& key) const {
+			::utimensat(AT_FDCWD, entry(key).c_str(), nullptr, 0);
+		}
+
+		std::optional<std::string> lookup(const std::string& key) const {
+			std::string path = entry(key);
+			int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				return std::nullopt;
+			std::string contents;
+			bool complete = false;
+			struct stat info;
+			if (::fstat(fd, &info) == 0) {
+				contents.resize(info.st_size);
+				size_t length = 0;
+				while (length < contents.size()) {
+					ssize_t count = ::read(fd, &contents[length], contents.size() - length);
+					if (count < 0 && errno == EINTR)
+						continue;
+					if (count <= 0)
+						break;
+					length += count;
+				}
+				complete = length == contents.size();
+				if (complete)
+					::futimens(fd, nullptr); // most recently used
+			}
+			::close(fd);
+			if (!complete)
+				return std::nullopt;
+			return contents;
+		}
+		// failing to store an entry only costs a later miss, errors are not reported
+		void insert(const std::string& key, std::string_view contents) const {
+			std::string file = temporary();
+			try {
+				write_file(file, contents);
+			} catch (std::exception&) {
+				::unlink(file.c_str());
+				return;
+			}
+			publish(file, key);
+			if (++inserted % trim_interval == 0)
+				trim();
+		}
+
+		// removes least recently used entries until the rest fit, other processes may remove them first
+		void trim() const {
+			struct file_t {
+				std::string path;
+				uint64_t size;
+				timespec used;
+			};
+			std::vector<file_t> files;
+			uint64_t total = 0;
+			DIR* listing = ::opendir(dir.c_str());
+			if (!listing)
+				return;
+			while (dirent* item = ::readdir(listing)) {
+				std::string_view name = item->d_name;
+				bool temporary = name.substr(0, 5) == ".tmp.";
+				if (!temporary && (name.size() < 2 || name.substr(name.size() - 2) != ".o" || name[0] == '.'))
+					continue;
+				std::string path = dir + "/" + item->d_name;
+				struct stat info;
+				if (::stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+					continue;
+				if (temporary) { // left behind by a process that died while inserting
+					if (info.st_mtime + 3600 < ::time(nullptr))
+						::unlink(path.c_str());
+					continue;
+				}
+				files.push_back({ path, (uint64_t)info.st_size, info.st_mtim });
+				total += info.st_size;
+			}
+			::closedir(listing);
+			if (total <= max_bytes)
+				return;
+			// timestamps are coarse, entries used at the same tick go in name order so every process agrees
+			std::sort(files.begin(), files.end(), [](const file_t& a, const file_t& b) {
+				return std::tie(a.used.tv_sec, a.used.tv_nsec, a.path) < std::tie(b.used.tv_sec, b.used.tv_nsec, b.path);
+			});
+			for (auto& file : files) {
+				if (total <= max_bytes)
+					break;
+				::unlink(file.path.c_str());
+				total -= file.size;
+			}
+		}
+	};
+}
+
+#endif
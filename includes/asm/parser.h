@@ -5,8 +5,10 @@
 #include <vector>
 #include <regex>
 #include <algorithm>
+#include <string_view>
 
 #include "asm/types.h"
+#include "asm/small_vector.h"
 #include "asm/errors.h"
 
 namespace ASM {
@@ -14,33 +16,45 @@ namespace ASM {
 	template <typename T> using vector = std::vector<T>;
 
 
+	using token = std::string_view;
+	// tokens of a single parsed element, views into the source buffer
+	using token_list = small_vector<token, 8>;
+
 	struct parsed_t {
 		flags_t flags;
-		vector<string> values;
-		parsed_t(flags_t flags, vector<string> values) : flags(flags), values(values) {}
+		token_list values;
+		instruction_t instr; // filled in for instructions once decoded
+		parsed_t(flags_t flags, token_list values) : flags(flags), values(values) {}
 	};
 
 	struct parser {
 		flags_t flags;
-		vector<string> regexes;
+		vector<std::regex> regexes; // compiled once when parser table is built
 		vector<vector<parser>> callbacks;
 		settings_t settings = DEFAULT;
 
-		parsed_t parse(const string& line) const {
-			std::vector<string> values;
+		parser(flags_t flags, const vector<string>& patterns, vector<vector<parser>> callbacks = {}, settings_t settings = DEFAULT)
+			: flags(flags), callbacks(std::move(callbacks)), settings(settings) {
+			regexes.reserve(patterns.size());
+			for (auto& pattern : patterns)
+				regexes.emplace_back(pattern, std::regex_constants::icase | std::regex_constants::optimize);
+		}
+
+		parsed_t parse(token line) const {
+			token_list values;
 			flags_t flags = 0; // no flags initially as no match is default
 			bool overriden = false;
 
 			for (auto& regex : regexes) {
-				std::smatch match;
-				if (std::regex_search(line, match, std::regex(regex, std::regex_constants::icase))) {
+				std::cmatch match;
+				if (std::regex_search(line.data(), line.data() + line.size(), match, regex)) {
 					// extract data from capture groups
 					for (size_t i = 1; i < match.size(); i++) {
-						values.push_back(match[i].str());
+						values.push_back(match[i].matched ? token(match[i].first, match[i].length()) : token());
 					}
 
 					// append suffix to the end as it is needed for recursion and callbacks
-					values.push_back(match.suffix());
+					values.push_back(token(match.suffix().first, match.suffix().length()));
 
 					// if recursive flag is passed repeat same regex set while its sucessful and append results
 					if (settings & RECURSIVE) {
@@ -94,6 +108,58 @@ namespace ASM {
 	}
 
 	static const vector<string> NUMCHAR_REGEXES = { "\\s*(\\d+)", "\\s*'(\\w)'", "\\s*'(\\\\\\w)'" };
+	// comma separated NUMCHAR list captured as a whole, so data directives are not parsed element by element
+	static const string NUMCHAR_LIST_REGEX = "\\s*((?:\\d+|'\\w'|'\\\\\\w')(?:\\s*,\\s*(?:\\d+|'\\w'|'\\\\\\w'))*)";
+
+	// number of elements in an already validated NUMCHAR list
+	static size_t numchar_count(token list) {
+		return std::count(list.begin(), list.end(), ',') + 1;
+	}
+	// calls fn with every element of an already validated NUMCHAR list, quotes of chars are stripped
+	template <typename F>
+	static void for_each_numchar(token list, F&& fn) {
+		while (!list.empty()) {
+			size_t comma = std::min(list.find(','), list.size());
+			token element = list.substr(0, comma);
+			element.remove_prefix(std::min(element.find_first_not_of(" \t"), element.size()));
+			element.remove_suffix(element.size() - std::min(element.find_last_not_of(" \t") + 1, element.size()));
+			if (element.size() > 2 && element.front() == '\'')
+				element = element.substr(1, element.size() - 2);
+			fn(element);
+			list.remove_prefix(std::min(comma + 1, list.size()));
+		}
+	}
+	// quoted string literals with \n \t \r \0 \\ \" \' escapes, captured as a whole list
+	static const string STRING_REGEX = "\"(?:[^\"\\\\]|\\\\[ntr0\\\\\"'])*\"";
+	static const string STRING_LIST_REGEX = "\\s*(" + STRING_REGEX + "(?:\\s*,\\s*" + STRING_REGEX + ")*)";
+
+	static char unescape(char c) {
+		switch (std::tolower((unsigned char)c)) {
+		case 'n': return '\n';
+		case 't': return '\t';
+		case 'r': return '\r';
+		case '0': return '\0';
+		default: return c;
+		}
+	}
+	// calls fn with every byte of an already validated string literal list, terminated adds zero after each literal
+	template <typename F>
+	static void for_each_string_byte(token list, bool terminated, F&& fn) {
+		for (size_t i = 0; i < list.size(); i++) {
+			if (list[i] != '"')
+				continue;
+			for (i++; list[i] != '"'; i++)
+				fn((uint8_t)(list[i] == '\\' ? unescape(list[++i]) : list[i]));
+			if (terminated)
+				fn(0);
+		}
+	}
+	static size_t string_length(token list, bool terminated) {
+		size_t length = 0;
+		for_each_string_byte(list, terminated, [&length](uint8_t) { length++; });
+		return length;
+	}
+
 	static const vector<string> REGISTER_REGEXES = { "\\s*r([0-7])", "\\s*(ax)", "\\s*(sp)", "\\s*(bp)", "\\s*(pc)" };
 
 	static vector<parser> ADDR_MODE_PARSERS(int op) {
@@ -127,7 +193,9 @@ namespace ASM {
 	// definition of parsers that do regex magic
 	const parser parsers[] = {
 		{LABEL, {"^\\s*(\\w+):"}},
-		{ALLOC,  "^\\s*\\.(byte|word|dword)" + NUMCHAR_REGEXES, {{ADDITIONAL_ELEMENT(NUMCHAR_REGEXES, RECURSIVE)}}},
+		{ALLOC,  {"^\\s*\\.(byte|word|dword)" + NUMCHAR_LIST_REGEX}},
+		{ASCII,  {"^\\s*\\.(ascii|asciz)" + STRING_LIST_REGEX}},
+		{INCBIN,{"^\\s*\\.incbin\\s*\"([^\"]*)\"(?:\\s*,\\s*(\\d+)(?:\\s*,\\s*(\\d+))?)?"}},
 		{ALIGN,  {"^\\s*\\.(align)\\s*(\\d+)" }, {{ADDITIONAL_ELEMENT({"(\\d+)"})}} },
 		{SKIP,  {"^\\s*\\.(skip)\\s*(\\d+)" }, {{ADDITIONAL_ELEMENT({"(\\d+)"})}} },
 		{SECTION, {"^\\s*\\.section\\s*\\\"\\.(\\w+)\\\"", "\\.(data)", "\\.(text)", "\\.(bss)"}},
@@ -145,6 +213,28 @@ namespace ASM {
 		{END, {"^\\s*\\.end"}}
 	};
 
+	// runs parser table over the line, returns part of the line that was not recognized
+	static token parse_line(token line, vector<parsed_t>& data) {
+		token rest = line;
+		for (auto& parser : parsers) {
+			parsed_t parsed = parser.parse(rest);
+			if (parsed.flags & SUCCESS) { // if flags are not set than nothing worthy is on the line!
+				// take out consumed data from line and leave only suffix
+				rest = parsed.values.back();
+				// suffix no longer needed as it contains unparsed data
+				parsed.values.pop_back();
+
+				// put that data in our parsed data
+				data.push_back(parsed);
+
+				// if something other than label is parsed we are done with parsing. // TODO: make this property flagable and modular
+				if (!(parsed.flags & LABEL))
+					break;
+			}
+		}
+		return rest;
+	}
+
 }
 
 
@@ -0,0 +1,66 @@
+#ifndef __ASM_PROGRAM_H__
+#define __ASM_PROGRAM_H__
+
+#include <vector>
+
+#include "asm/parser.h"
+#include "asm/arena.h"
+
+namespace ASM {
+
+	// Tokenized source as recorded by the first pass, so later passes can replay it from memory
+	// without reading or parsing the file again. Every non empty line keeps its number, text and
+	// section, while parsed elements of all lines are stored back to back in a single array.
+	// Tokens are views into the source_file, which has to outlive the program, as does the arena
+	// both arrays are allocated from.
+	class program {
+	public:
+		struct line_t {
+			int line_num;
+			token line;
+			token section;
+			uint32_t first; // index of first parsed element of the line
+			uint32_t count; // number of parsed elements on the line
+		};
+	private:
+		std::vector<line_t, arena_allocator<line_t>> lines;
+		std::vector<parsed_t, arena_allocator<parsed_t>> elements;
+	public:
+		program(arena& memory) : lines(memory), elements(memory) {}
+
+		template <typename Context>
+		void record(const Context& context) {
+			lines.push_back(line_t{ context.line_num, context.line, context.section, (uint32_t)elements.size(), (uint32_t)context.data.size() });
+			elements.insert(elements.end(), context.data.begin(), context.data.end());
+		}
+
+		// arrays growing inside an arena leave their old copies behind, so reserving matters
+		void reserve(size_t line_count) {
+			lines.reserve(line_count);
+			elements.reserve(line_count);
+		}
+
+		auto begin() const {
+			return lines.begin();
+		}
+		auto end() const {
+			return lines.end();
+		}
+		size_t size() const {
+			return lines.size();
+		}
+		const line_t& operator[](size_t index) const {
+			return lines[index];
+		}
+
+		// parsed elements belonging to the line
+		const parsed_t* begin(const line_t& line) const {
+			return elements.data() + line.first;
+		}
+		const parsed_t* end(const line_t& line) const {
+			return elements.data() + line.first + line.count;
+		}
+	};
+}
+
+#endif
@@ -0,0 +1,294 @@
+#ifndef __ASM_SERVER_H__
+#define __ASM_SERVER_H__
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "asm/thread_pool.h"
+
+namespace ASM {
+	// Requests and responses of the assembler server. Every message is a field count followed by
+	// the fields, each a length and its bytes, all counts little endian 32-bit. A connection carries
+	// one request and its response.
+	namespace remote {
+		static constexpr size_t max_message = 256u << 20; // bytes, lengths past it are not allocated
+		using deadline_t = std::chrono::steady_clock::time_point;
+
+		struct request_t {
+			std::string command = "assemble"; // assemble or stop
+			std::string input, output; // absolute paths, the server does not share the client's directory
+			std::string parser = "lexer", format = "text";
+			bool has_source = false; // source is sent inline instead of being read from input
+			std::string source;
+		};
+		struct response_t {
+			int status = 0; // exit status the client should return
+			std::string log; // pass trace and resulting tables
+			size_t lines = 0;
+			bool cache = false; // server keeps an object cache, counters below are only kept then
+			size_t cache_hits = 0, cache_misses = 0;
+			std::vector<std::string> diagnostics; // one message per error
+		};
+
+		struct socket_error : std::system_error {
+			socket_error(const std::string& what) : std::system_error(errno, std::system_category(), what) {}
+		};
+
+		// closes the descriptor when it goes out of scope
+		struct fd_t {
+			int fd;
+			explicit fd_t(int fd) : fd(fd) {}
+			fd_t(const fd_t&) = delete;
+			~fd_t() {
+				if (fd >= 0)
+					::close(fd);
+			}
+			operator int() const { return fd; }
+		};
+
+		static void send_all(int fd, const char* data, size_t size) {
+			while (size > 0) {
+				ssize_t count = ::send(fd, data, size, MSG_NOSIGNAL);
+				if (count < 0 && errno == EINTR)
+					continue;
+				if (count < 0)
+					throw socket_error("Cannot send message");
+				data += count;
+				size -= count;
+			}
+		}
+		// false when the peer closed the connection before the first byte, waits are bounded by deadline
+		static bool receive_all(int fd, char* data, size_t size, deadline_t deadline = deadline_t::max()) {
+			for (size_t received = 0; received < size;) {
+				if (deadline != deadline_t::max()) {
+					auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+					pollfd ready{ fd, POLLIN, 0 };
+					int polled = left.count() > 0 ? ::poll(&ready, 1, (int)std::min<long long>(left.count(), INT32_MAX)) : 0;
+					if (polled < 0 && errno == EINTR)
+						continue;
+					if (polled < 0)
+						throw socket_error("Cannot receive message");
+					if (polled == 0)
+						throw std::runtime_error("Timed out waiting for message");
+				}
+				ssize_t count = ::recv(fd, data + received, size - received, 0);
+				if (count < 0 && errno == EINTR)
+					continue;
+				if (count < 0)
+					throw socket_error("Cannot receive message");
+				if (count == 0) {
+					if (received == 0)
+						return false;
+					throw std::runtime_error("Connection closed in the middle of a message");
+				}
+				received += count;
+			}
+			return true;
+		}
+
+		static void put_u32(std::string& out, uint32_t value) {
+			for (int i = 0; i < 4; i++)
+				out += (char)(value >> i * 8);
+		}
+		static uint32_t get_u32(const char* in) {
+			uint32_t value = 0;
+			for (int i = 0; i < 4; i++)
+				value |= (uint32_t)(uint8_t)in[i] << i * 8;
+			return value;
+		}
+
+		static void send_message(int fd, const std::vector<std::string>& fields) {
+			std::string out;
+			put_u32(out, fields.size());
+			for (auto& field : fields) {
+				put_u32(out, field.size());
+				out += field;
+			}
+			send_all(fd, out.data(), out.size());
+		}
+		static bool receive_message(int fd, std::vector<std::string>& fields, deadline_t deadline = deadline_t::max()) {
+			char header[4];
+			if (!receive_all(fd, header, 4, deadline))
+				return false;
+			uint32_t count = get_u32(header);
+			size_t left = max_message - 4; // every length is checked against it before anything is allocated
+			if (count > left / 4)
+				throw std::runtime_error("Malformed message, too many fields");
+			left -= count * 4;
+			fields.assign(count, {});
+			for (auto& field : fields) {
+				if (!receive_all(fd, header, 4, deadline))
+					throw std::runtime_error("Connection closed in the middle of a message");
+				uint32_t length = get_u32(header);
+				if (length > left)
+					throw std::runtime_error("Malformed message, larger than the limit");
+				left -= length;
+				field.resize(length);
+				if (!field.empty() && !receive_all(fd, &field[0], field.size(), deadline))
+					throw std::runtime_error("Connection closed in the middle of a message");
+			}
+			return true;
+		}
+
+		static std::vector<std::string> encode(const request_t& request) {
+			return { request.command, request.input, request.output, request.parser, request.format,
+				request.has_source ? "1" : "0", request.source };
+		}
+		static request_t decode_request(std::vector<std::string>& fields) {
+			if (fields.size() != 7)
+				throw std::runtime_error("Malformed request");
+			request_t request;
+			request.command = std::move(fields[0]);
+			request.input = std::move(fields[1]);
+			request.output = std::move(fields[2]);
+			request.parser = std::move(fields[3]);
+			request.format = std::move(fields[4]);
+			request.has_source = fields[5] == "1";
+			request.source = std::move(fields[6]);
+			return request;
+		}
+		static std::vector<std::string> encode(const response_t& response) {
+			std::vector<std::string> fields = { std::to_string(response.status), response.log, std::to_string(response.lines),
+				response.cache ? "1" : "0", std::to_string(response.cache_hits), std::to_string(response.cache_misses) };
+			fields.insert(fields.end(), response.diagnostics.begin(), response.diagnostics.end());
+			return fields;
+		}
+		static response_t decode_response(std::vector<std::string>& fields) {
+			if (fields.size() < 6)
+				throw std::runtime_error("Malformed response");
+			response_t response;
+			response.status = std::stoi(fields[0]);
+			response.log = std::move(fields[1]);
+			response.lines = std::stoull(fields[2]);
+			response.cache = fields[3] == "1";
+			response.cache_hits = std::stoull(fields[4]);
+			response.cache_misses = std::stoull(fields[5]);
+			for (size_t i = 6; i < fields.size(); i++)
+				response.diagnostics.push_back(std::move(fields[i]));
+			return response;
+		}
+
+		static sockaddr_un socket_address(const std::string& path) {
+			sockaddr_un address{};
+			address.sun_family = AF_UNIX;
+			if (path.size() >= sizeof(address.sun_path))
+				throw std::runtime_error("Socket path is too long: " + path);
+			std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+			return address;
+		}
+
+		// sends request to the server listening on path and waits for its response
+		static response_t call(const std::string& path, const request_t& request) {
+			sockaddr_un address = socket_address(path);
+			fd_t fd(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+			if (fd < 0)
+				throw socket_error("Cannot create socket");
+			if (::connect(fd, (sockaddr*)&address, sizeof(address)) != 0)
+				throw socket_error("Cannot connect to server at " + path);
+			send_message(fd, encode(request));
+			std::vector<std::string> fields;
+			if (!receive_message(fd, fields))
+				throw std::runtime_error("Server closed the connection without a response");
+			return decode_response(fields);
+		}
+
+		// Accepts connections on a Unix socket and answers each on a pool of jobs threads.
+		// handler runs on the worker, returns false for a request that stops the server.
+		class server {
+		public:
+			using handler_t = std::function<bool(request_t& request, response_t& response)>;
+		private:
+			std::string path;
+			fd_t listener;
+			handler_t handler;
+			thread_pool pool;
+		public:
+			std::chrono::milliseconds receive_timeout{ 10000 }; // longest time a client may take to send its whole request
+		private:
+
+			// only processes of the user running the server may stop it
+			static void check_peer(int connection) {
+				ucred peer{};
+				socklen_t length = sizeof(peer);
+				if (::getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &length) != 0)
+					throw socket_error("Cannot identify client");
+				if (peer.uid != ::geteuid())
+					throw std::runtime_error("Not allowed to stop the server");
+			}
+
+			void answer(int client) {
+				fd_t connection(client);
+				response_t response;
+				bool keep_running = true;
+				try {
+					// a client that sends slowly or stops sending does not hold the worker for longer than this
+					std::vector<std::string> fields;
+					if (!receive_message(connection, fields, std::chrono::steady_clock::now() + receive_timeout))
+						return;
+					request_t request = decode_request(fields);
+					if (request.command == "stop")
+						check_peer(connection);
+					keep_running = handler(request, response);
+				} catch (std::exception& err) {
+					response = response_t{};
+					response.status = 1;
+					response.diagnostics.push_back(err.what());
+				}
+				try {
+					send_message(connection, encode(response));
+				} catch (std::exception&) {
+					// client went away, nothing to report to
+				}
+				if (!keep_running)
+					::shutdown(listener, SHUT_RDWR); // wakes accept in run
+			}
+		public:
+			// a stale socket file left by a server that is gone is replaced
+			server(const std::string& path, size_t jobs, handler_t handler)
+				: path(path), listener(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)), handler(std::move(handler)), pool(jobs) {
+				if (listener < 0)
+					throw socket_error("Cannot create socket");
+				sockaddr_un address = socket_address(path);
+				fd_t probe(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+				if (probe >= 0 && ::connect(probe, (sockaddr*)&address, sizeof(address)) == 0)
+					throw std::runtime_error("A server is already listening at " + path);
+				::unlink(path.c_str());
+				if (::bind(listener, (sockaddr*)&address, sizeof(address)) != 0)
+					throw socket_error("Cannot bind socket " + path);
+				if (::listen(listener, 128) != 0)
+					throw socket_error("Cannot listen on socket " + path);
+			}
+			~server() {
+				pool.wait();
+				::unlink(path.c_str());
+			}
+
+			// serves until a handler asks to stop, requests in progress are finished before returning
+			void run() {
+				for (;;) {
+					int client = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+					if (client < 0 && (errno == EINTR || errno == ECONNABORTED))
+						continue;
+					if (client < 0)
+						break; // listener was shut down
+					pool.submit([this, client] { answer(client); });
+				}
+				pool.wait();
+			}
+		};
+	}
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef __ASM_SMALL_VECTOR_H__
+#define __ASM_SMALL_VECTOR_H__
+
+#include <vector>
+#include <algorithm>
+
+namespace ASM {
+	// vector that keeps first N elements inline and only goes to the heap once it outgrows them
+	template <typename T, size_t N>
+	class small_vector {
+		T inline_data[N];
+		std::vector<T> heap;
+		size_t count = 0;
+		bool spilled = false;
+
+		T* data() { return spilled ? heap.data() : inline_data; }
+		const T* data() const { return spilled ? heap.data() : inline_data; }
+	public:
+		small_vector() = default;
+		small_vector(std::initializer_list<T> list) {
+			for (auto& elem : list)
+				push_back(elem);
+		}
+
+		void push_back(const T& value) {
+			if (!spilled && count < N) {
+				inline_data[count++] = value;
+				return;
+			}
+			if (!spilled) {
+				heap.assign(inline_data, inline_data + count);
+				spilled = true;
+			}
+			heap.push_back(value);
+			count++;
+		}
+		void pop_back() {
+			if (spilled) heap.pop_back();
+			count--;
+		}
+		template <typename It>
+		void insert(const T* pos, It first, It last) { // only appending is supported
+			for (; first != last; ++first)
+				push_back(*first);
+		}
+		void clear() {
+			heap.clear();
+			count = 0;
+			spilled = false;
+		}
+
+		size_t size() const { return count; }
+		bool empty() const { return count == 0; }
+		T& operator[](size_t index) { return data()[index]; }
+		const T& operator[](size_t index) const { return data()[index]; }
+		T& back() { return data()[count - 1]; }
+		const T& back() const { return data()[count - 1]; }
+		T* begin() { return data(); }
+		T* end() { return data() + count; }
+		const T* begin() const { return data(); }
+		const T* end() const { return data() + count; }
+
+		bool operator==(const small_vector& rhs) const {
+			return std::equal(begin(), end(), rhs.begin(), rhs.end());
+		}
+		bool operator!=(const small_vector& rhs) const { return !(*this == rhs); }
+	};
+}
+
+#endif
@@ -2,8 +2,15 @@
 #define __SOURCE_ITERATOR_H__
 
 #include "parser.h"
+#include "lexer.h"
 #include "errors.h"
 #include <fstream>
+#include <sstream>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // Helper expanding macro that checks for partial struct equality given respectable struct's fields
 #ifndef STRUCT_EQ
@@ -25,6 +32,53 @@ namespace ASM {
 	using string = std::string;
 	template <typename T> using vector = std::vector<T>;
 
+	enum class parser_engine { LEXER, REGEX };
+
+	// whole source file held in memory for the entire assembly, parsed tokens are views into it.
+	// Regular files are memory mapped, anything else (pipes, empty files) is read into a buffer.
+	class source_file {
+		string content;
+		void* mapping = MAP_FAILED;
+		size_t length = 0;
+	public:
+		explicit source_file(const string& path) {
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				throw std::runtime_error("Cannot open source file " + path);
+			struct stat info;
+			if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+				length = info.st_size;
+				mapping = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (mapping != MAP_FAILED)
+					::madvise(mapping, length, MADV_SEQUENTIAL);
+			}
+			::close(fd);
+
+			if (mapping == MAP_FAILED) {
+				std::ifstream source(path, std::ios::in | std::ios::binary);
+				std::ostringstream oss;
+				oss << source.rdbuf();
+				content = oss.str();
+			}
+		}
+		// contents that are already in memory, nothing is read
+		struct in_memory_t {};
+		static constexpr in_memory_t in_memory{};
+		source_file(in_memory_t, string contents) : content(std::move(contents)) {}
+		source_file(const source_file&) = delete;
+		source_file& operator=(const source_file&) = delete;
+		~source_file() {
+			if (mapping != MAP_FAILED)
+				::munmap(mapping, length);
+		}
+		bool mapped() const {
+			return mapping != MAP_FAILED;
+		}
+		std::string_view view() const {
+			return mapped() ? std::string_view((const char*)mapping, length) : std::string_view(content);
+		}
+	};
+
 	class source_iterator {
 		using iterator_category = std::input_iterator_tag;
 		using value_type = string;
@@ -34,54 +88,48 @@ namespace ASM {
 		using self_type = source_iterator;
 
 		struct context_t {
-			string section = "UND";
+			token section = "UND";
 			vector<parsed_t> data;
 			int line_num = 0;
-			string line;
+			token line;
 		};
 
-		std::ifstream source;
+		std::shared_ptr<const source_file> owned; // only set when iterator opened the file itself
+		std::string_view source;
+		size_t offset = 0;
 		context_t context;
+		parser_engine engine;
 	public:
-		source_iterator(string path) : source(path) { operator++(); }
+		source_iterator(const source_file& file, parser_engine engine = parser_engine::LEXER) : source(file.view()), engine(engine) { operator++(); }
+		source_iterator(string path, parser_engine engine = parser_engine::LEXER)
+			: owned(std::make_shared<source_file>(path)), source(owned->view()), engine(engine) { operator++(); }
 		self_type& operator++(){
-			// obtain new line from source and early exit if EOF reached
-			if (!std::getline(source, context.line)) {
-				context.line_num = EOF;
-				return *this;
-			}
-			context.line_num++;
-
-			// reset data on every new iteration
-			context.data.clear();
-
-			string line = context.line;
-			for (auto& parser : parsers) {
-				parsed_t data = parser.parse(line);
-				if (data.flags & SUCCESS) { // if flags are not set than nothing worthy is on the line!
-					// take out consumed data from line and leave only suffix
-					line = data.values.back();
-					// suffix no longer needed as it contains unparsed data
-					data.values.pop_back();
+			// skip empty lines as they don't do anything to source code
+			do {
+				// obtain new line from source and early exit if EOF reached
+				if (offset >= source.size()) {
+					context.line_num = EOF;
+					return *this;
+				}
+				size_t newline = std::min(source.find('\n', offset), source.size());
+				context.line = source.substr(offset, newline - offset);
+				offset = newline + 1;
+				context.line_num++;
 
-					// put that data in our parsed data
-					context.data.push_back(data);
+				// reset data on every new iteration
+				context.data.clear();
 
+				token line = engine == parser_engine::REGEX ? parse_line(context.line, context.data) : lexer::lex(context.line, context.data);
+				for (auto& data : context.data)
 					if (data.flags & SECTION)
 						context.section = data.values[0];
-					// if something other than label is parsed we are done with parsing. // TODO: make this property flagable and modular
-					if (!(data.flags & LABEL))
-						break;
-				}
-			}
 
-			// if there are nonwhitespace characters not picked up by parsers that is syntax error
-			if (!std::all_of(line.begin(), line.end(), isspace)) {
-				throw syntax_error("Complete line was not processed. Leftover: " + line);
-			}
-				
-			// skip empty lines as they don't do anything to source code
-			return context.data.empty() ? operator++() : *this;
+				// if there are nonwhitespace characters not picked up by parsers that is syntax error
+				if (!std::all_of(line.begin(), line.end(), isspace)) {
+					throw syntax_error("Complete line was not processed. Leftover: " + string(line));
+				}
+			} while (context.data.empty());
+			return *this;
 		}
 		bool operator==(const self_type& rhs) { return STRUCT_EQ(context, rhs.context, line_num); }
 		bool operator!=(const self_type& rhs) { return !STRUCT_EQ(context, rhs.context, line_num); }
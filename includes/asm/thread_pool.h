@@ -0,0 +1,79 @@
+#ifndef __ASM_THREAD_POOL_H__
+#define __ASM_THREAD_POOL_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ASM {
+	// Fixed set of workers taking tasks from one queue in submission order. Tasks are whole file
+	// assemblies or server requests, so a single lock is never contended for long, and first in
+	// first out lets early batch inputs finish first, as their output is printed in input order.
+	class thread_pool {
+		using task_t = std::function<void()>;
+
+		std::vector<std::thread> workers;
+		std::mutex lock;
+		std::condition_variable wake, done;
+		std::deque<task_t> tasks;
+		size_t pending = 0; // submitted but not finished yet
+		bool stopping = false;
+
+		void work() {
+			std::unique_lock<std::mutex> guard(lock);
+			for (;;) {
+				wake.wait(guard, [this] { return stopping || !tasks.empty(); });
+				if (tasks.empty())
+					return; // stopping with nothing left
+				task_t task = std::move(tasks.front());
+				tasks.pop_front();
+				guard.unlock();
+				task();
+				task = nullptr; // captures are released before the task counts as finished
+				guard.lock();
+				if (--pending == 0)
+					done.notify_all();
+			}
+		}
+	public:
+		explicit thread_pool(size_t threads) {
+			threads = std::max<size_t>(threads, 1);
+			for (size_t i = 0; i < threads; i++)
+				workers.emplace_back(&thread_pool::work, this);
+		}
+		thread_pool(const thread_pool&) = delete;
+		thread_pool& operator=(const thread_pool&) = delete;
+		~thread_pool() {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				stopping = true;
+			}
+			wake.notify_all();
+			for (auto& worker : workers)
+				worker.join();
+		}
+
+		// tasks must not throw, they report their own failures
+		void submit(task_t task) {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				tasks.push_back(std::move(task));
+				pending++;
+			}
+			wake.notify_one();
+		}
+		// blocks until every submitted task has finished
+		void wait() {
+			std::unique_lock<std::mutex> guard(lock);
+			done.wait(guard, [this] { return pending == 0; });
+		}
+		size_t size() const {
+			return workers.size();
+		}
+	};
+}
+
+#endif
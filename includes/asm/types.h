@@ -9,6 +9,8 @@
 #include <sstream>
 #include <vector>
 #include <iomanip>
+#include <optional>
+#include <algorithm>
 #include "asm/utils.h"
 #include "asm/hashvec.h"
 #include "asm/errors.h"
@@ -29,7 +31,7 @@ namespace ASM {
 	constexpr auto OP_DESC_SZ = 8;
 	constexpr auto REG_NUM	= 7;
 
-	int GET_REG(const string& name) {
+	int GET_REG(std::string_view name) {
 		if (name == "ax") return 0;
 		else if (name == "bx")	return 1;
 		else if (name == "cx")	return 2;
@@ -38,7 +40,7 @@ namespace ASM {
 		else if (name == "sp")	return 6;
 		else if (name == "pc")	return 7;
 		else try {
-			int num = std::stoi(name);
+			int num = utils::stoi(name);
 			if (num < 0 || num > REG_NUM)
 				throw syntax_error("Invalid register number supplied");
 			return num;
@@ -105,6 +107,8 @@ namespace ASM {
 
 	enum Types {
 		NOFLAG		= 0x000 << OP_NUM * OP_DESC_SZ,
+		ASCII		= 0x2000 << OP_NUM * OP_DESC_SZ,
+		INCBIN		= 0x1000 << OP_NUM * OP_DESC_SZ,
 		END			= 0x800 << OP_NUM * OP_DESC_SZ,
 		SKIP		= 0x400 << OP_NUM * OP_DESC_SZ,
 		ALIGN		= 0x200 << OP_NUM * OP_DESC_SZ,
@@ -143,8 +147,33 @@ namespace ASM {
 		flags_t flags = 0;
 	};
 
+	// single operand of a decoded instruction
+	struct operand_t {
+		// address modes as encoded in the operand descriptor
+		enum mode_t : uint8_t { IMMED, REGDIR, REGIND, REGIND8, REGIND16, MEM };
+		// how the symbol (if any) in the operand is addressed
+		enum symbol_t : uint8_t { NONE, ABS, REL, ADR };
+
+		mode_t mode = IMMED;
+		symbol_t symbol = NONE;
+		uint8_t reg = 0;
+		bool high = false;	// higher half of reduced register
+		uint32_t name = 0;	// interned symbol name, valid when symbol is set
+		uint16_t value = 0;	// immediate, memory address or displacement
+	};
+
+	// typed form of an instruction line, both passes work on it instead of tokens
+	struct instruction_t {
+		uint8_t opcode = 0;	// index in optable
+		uint8_t size = 0;	// operand size in bytes, 0 for instructions without operands
+		uint8_t count = 0;	// number of operands
+		operand_t operands[OP_NUM];
+	};
+
 	struct Symbol {
-		string section;
+		static constexpr uint32_t EXTERN = 0xFFFFFFFF; // not defined in this file, printed as RELOC
+
+		uint32_t section;	// index in section table
 		uint offset;
 		bool isLocal = true;
 	};
@@ -154,53 +183,307 @@ namespace ASM {
 			R_386_PC16, R_386_16
 		} reloc_t;
 
-		string section;
+		uint32_t section;	// index in section table
 		uint offset;
 		uint num;
 		reloc_t type;
 	};
 
+	// relocations grouped by the id of the section they patch, each group is kept in offset order
+	class relocation_table {
+		vector<vector<Relocation>> groups;
+		size_t count = 0;
+	public:
+		void add(const Relocation& relocation) {
+			if (groups.size() <= relocation.section)
+				groups.resize(relocation.section + 1);
+			vector<Relocation>& group = groups[relocation.section];
+			// code is written front to back, so only relocations added out of order need a search
+			if (group.empty() || group.back().offset <= relocation.offset)
+				group.push_back(relocation);
+			else
+				group.insert(std::upper_bound(group.begin(), group.end(), relocation.offset,
+					[](uint offset, const Relocation& rhs) { return offset < rhs.offset; }), relocation);
+			count++;
+		}
+		// relocations of a section in offset order
+		const vector<Relocation>& of(uint32_t section) const {
+			static const vector<Relocation> none;
+			return section < groups.size() ? groups[section] : none;
+		}
+		// one past the highest section id with a group
+		uint32_t sections() const {
+			return groups.size();
+		}
+		size_t size() const {
+			return count;
+		}
+		// groups keep their storage for the next run
+		void clear() {
+			for (auto& group : groups)
+				group.clear();
+			count = 0;
+		}
+	};
+
 	struct Constant {
 		int value;
 	};
 
 	struct Section {
 		uint counter = 0;
+
+		// stores byte_number bytes of value at dst in target byte order
+		static void store(uint8_t* dst, uint value, int byte_number) {
+#ifdef LITTLE_ENDIAN
+			for (int i = 0; i < byte_number; i++)
+				dst[i] = value >> (i * 8);
+#else
+			for (int i = 0; i < byte_number; i++)
+				dst[byte_number - 1 - i] = value >> (i * 8);
+#endif
+		}
+		static uint16_t load(const uint8_t* src, int byte_number) {
+			uint16_t value = 0;
+#ifdef LITTLE_ENDIAN
+			for (int i = byte_number - 1; i >= 0; i--)
+				value = value << 8 | src[i];
+#else
+			for (int i = 0; i < byte_number; i++)
+				value = value << 8 | src[i];
+#endif
+			return value;
+		}
+		// skips at least this long are kept as runs instead of bytes
+		static constexpr uint RUN_MIN = 16;
+
+		// repeated byte standing in for length bytes at offset
+		struct run_t {
+			uint offset;
+			uint length;
+			uint8_t value;
+			uint before; // bytes in runs preceding this one
+		};
+
+		bool bss = false; // skipped space is always kept as runs, nothing is stored unless written explicitly
 	private:
-		vector<uint8_t> data;
+		vector<uint8_t> data; // bytes outside of runs
+		vector<run_t> runs;
+		uint run_bytes = 0;
+		uint runs_passed = 0; // bytes in runs before counter
+		size_t next_run = 0;
+
+		// claims n bytes at counter for positional writes, sections that were not allocated grow instead
+		uint8_t* claim(uint n) {
+			uint index = counter - runs_passed;
+			if (index + n > data.size())
+				data.resize(index + n);
+			uint8_t* dst = data.data() + index;
+			counter += n;
+			return dst;
+		}
+		// run covering offset, nullptr if byte at offset is stored
+		const run_t* find_run(uint offset) const {
+			auto it = std::upper_bound(runs.begin(), runs.end(), offset, [](uint offset, const run_t& run) { return offset < run.offset; });
+			if (it == runs.begin())
+				return nullptr;
+			--it;
+			return offset < it->offset + it->length ? &*it : nullptr;
+		}
+		// position in data of the stored byte at offset
+		uint index(uint offset) const {
+			if (runs.empty())
+				return offset;
+			auto it = std::upper_bound(runs.begin(), runs.end(), offset, [](uint offset, const run_t& run) { return offset < run.offset; });
+			return it == runs.begin() ? offset : offset - (it - 1)->before - (it - 1)->length;
+		}
+		uint8_t at(uint offset) const {
+			const run_t* run = find_run(offset);
+			return run ? run->value : data[index(offset)];
+		}
 		class stream {
 			Section& m_section;
 			uint bitsize;
+			void check(uint mask) const {
+				if ((uint)utils::bitsize(mask) > bitsize)
+					throw std::overflow_error("Overflow. Number passed is larger than stream");
+			}
 		public:
 			stream(Section& section, uint bitsize) :m_section(section), bitsize(bitsize) {}
 			const stream& operator<<(int number) const {
-				if (utils::bitsize(number) > bitsize)
+				check(number);
+				store(m_section.claim(bitsize / 8), number, bitsize / 8);
+				return *this;
+			}
+			// writes number count times
+			const stream& fill(int number, uint count) const {
+				check(number);
+				uint8_t* dst = m_section.claim(count * bitsize / 8);
+				if (bitsize == 8)
+					std::fill_n(dst, count, (uint8_t)number);
+				else for (uint i = 0; i < count; i++, dst += bitsize / 8)
+					store(dst, number, bitsize / 8);
+				return *this;
+			}
+			// writes all numbers from the range, checking them once for overflow
+			template <typename It>
+			const stream& write(It first, It last) const {
+				uint mask = 0;
+				for (It it = first; it != last; ++it)
+					mask |= *it;
+				check(mask);
+				uint8_t* dst = m_section.claim(std::distance(first, last) * bitsize / 8);
+				if (bitsize == 8)
+					std::copy(first, last, dst);
+				else for (; first != last; ++first, dst += bitsize / 8)
+					store(dst, *first, bitsize / 8);
+				return *this;
+			}
+			// writes count numbers in place, generate(emit) has to call emit(number) for each of them
+			template <typename F>
+			const stream& generate(uint count, F&& generate) const {
+				uint width = bitsize / 8, written = 0, mask = 0;
+				size_t stored = m_section.data.size();
+				uint8_t* dst = m_section.claim(count * width);
+				generate([&](int number) {
+					if (written < count)
+						store(dst + written * width, number, width);
+					mask |= number;
+					written++;
+				});
+				if (written != count || (uint)utils::bitsize(mask) > bitsize) {
+					m_section.counter -= count * width; // nothing is kept from failed write
+					m_section.data.resize(stored);
+					if (written != count)
+						throw std::logic_error("Generated number count differs from the one claimed");
 					throw std::overflow_error("Overflow. Number passed is larger than stream");
-#ifdef LITTLE_ENDIAN
-				for (int i = 0; i < bitsize; i += 8) {
-					m_section.counter++;
-					m_section.data.push_back(number >> i);
-				}
-#else
-				for (int i = bitsize - 8; i >= 0; i -= 8) {
-					m_section.counter++;
-					m_section.data.push_back(number >> i);
 				}
-#endif
 				return *this;
 			}
 		};
 	public:
+		// streams are not moved, every section initializes its own bound to itself
 		Section() = default;
-		Section(const Section& rhs) {
-			counter = rhs.counter;
-			data = rhs.data;
+		Section(const Section&) = delete;
+		Section(Section&& rhs) noexcept {
+			*this = std::move(rhs);
+		}
+		Section& operator=(Section&& rhs) noexcept {
+			counter = std::exchange(rhs.counter, 0);
+			bss = rhs.bss;
+			data = std::move(rhs.data);
+			runs = std::move(rhs.runs);
+			run_bytes = std::exchange(rhs.run_bytes, 0);
+			runs_passed = std::exchange(rhs.runs_passed, 0);
+			next_run = std::exchange(rhs.next_run, 0);
+			return *this;
+		}
+		// raw bytes, already in target byte order
+		void write(const uint8_t* src, uint n) {
+			std::copy_n(src, n, claim(n));
+		}
+		// whether a skip of count bytes is kept as a run
+		bool keeps_run(uint count) const {
+			return bss || count >= RUN_MIN;
+		}
+		// first pass: count bytes of value at counter are recorded as a run
+		void reserve_run(uint count, int value) {
+			if (utils::bitsize(value) > 8)
+				throw std::overflow_error("Overflow. Number passed is larger than stream");
+			if (!runs.empty() && runs.back().offset + runs.back().length == counter && runs.back().value == value)
+				runs.back().length += count;
+			else
+				runs.push_back(run_t{ counter, count, (uint8_t)value, run_bytes }); // range checked above
+			run_bytes += count;
+			counter += count;
 		}
+		// second pass: passes over count bytes of runs recorded at counter by first pass
+		void skip_run(uint count) {
+			while (count) {
+				if (next_run == runs.size() || counter < runs[next_run].offset)
+					throw std::logic_error("Skipped run was not recorded by first pass");
+				const run_t& run = runs[next_run];
+				uint step = std::min(count, run.offset + run.length - counter);
+				counter += step;
+				runs_passed += step;
+				count -= step;
+				if (counter == run.offset + run.length)
+					next_run++;
+			}
+		}
+		// .bss that holds nothing but zeros, it only has a size
+		bool nobits() const {
+			return bss && data.empty() && std::all_of(runs.begin(), runs.end(), [](const run_t& run) { return run.value == 0; });
+		}
+
+		// keeps counter of the first pass as final size of the section and rewinds it for writing
+		void allocate() {
+			data.assign(counter - run_bytes, 0);
+			counter = 0;
+			runs_passed = 0;
+			next_run = 0;
+		}
+		// final size once allocated, otherwise number of bytes written so far
+		uint size() const {
+			return data.size() + run_bytes;
+		}
+		// little endian value of byte_number bytes at offset, empty when they are not written yet
+		std::optional<uint16_t> peek(uint offset, int byte_number) const {
+			if (offset + byte_number > counter)
+				return std::nullopt;
+			if (runs.empty())
+				return load(data.data() + offset, byte_number);
+			uint8_t bytes[sizeof(uint16_t)];
+			for (int i = 0; i < byte_number; i++)
+				bytes[i] = at(offset + i);
+			return load(bytes, byte_number);
+		}
+		template <typename T>
+		T read(uint offset) const {
+			auto value = peek(offset, sizeof(T));
+			if (!value)
+				throw std::out_of_range("Section read past written data");
+			return *value;
+		}
+		// overwrites already written bytes at offset
+		template <typename T>
+		void patch(uint offset, T value) {
+			if (offset + sizeof(T) > counter)
+				throw std::out_of_range("Section patch past written data");
+			for (uint i = 0; i < sizeof(T); i++)
+				if (find_run(offset + i))
+					throw std::out_of_range("Section patch inside of a run");
+			store(data.data() + index(offset), value, sizeof(T));
+		}
+		// calls bytes(pointer, length) for stored parts and run(value, length) for runs, in section order
+		template <typename Bytes, typename Run>
+		void visit(Bytes&& bytes, Run&& run) const {
+			uint stored = 0;
+			for (const run_t& r : runs) {
+				uint length = r.offset - r.before - stored;
+				if (length)
+					bytes(data.data() + stored, length);
+				stored += length;
+				run(r.value, r.length);
+			}
+			if (stored < data.size())
+				bytes(data.data() + stored, data.size() - stored);
+		}
+		// contents with runs expanded
 		string memdump() const {
-			std::ostringstream oss;
-			for (auto& byte : data)
-				oss << std::setfill('0') << std::setw(2) << std::hex << std::uppercase << (int)byte;
-			return oss.str();
+			string dump(size() * 2, '\0');
+			char* dst = dump.data();
+			auto put = [&dst](uint8_t value) {
+				*dst++ = utils::HEX_PAIRS[value * 2];
+				*dst++ = utils::HEX_PAIRS[value * 2 + 1];
+			};
+			visit([&put](const uint8_t* bytes, uint length) {
+				std::for_each(bytes, bytes + length, put);
+			}, [&put](uint8_t value, uint length) {
+				for (uint i = 0; i < length; i++)
+					put(value);
+			});
+			return dump;
 		}
 		const stream bytes{ *this, 8 };
 		const stream words{ *this, WORD_SZ * 8 };
@@ -218,50 +501,130 @@ namespace ASM {
 
 
 
-	// specialization for pretty hashvec output
-	std::ostream& operator<<(std::ostream& stream, const hashvec<Symbol>& symbols) {
-		stream << "#tabela simbola\n";
-		stream << "#ime" << '\t' << "sek" << '\t' << "vr." << '\t' << "vid." << '\t' << "r.b." << '\n';
-		for (const auto& symbol : symbols) {
-			stream << symbol.key << '\t' << symbol.section << '\t' << symbol.offset << '\t' << (symbol.isLocal ? "local" : "global") << '\t' << symbol.index << '\n';
+	// table whose entries refer to sections by id, names are looked up only when printing
+	template <typename Table>
+	struct with_sections_t {
+		const Table& table;
+		const hashvec<Section>& sections;
+
+		const string& name(uint32_t section) const {
+			static const string reloc = "RELOC";
+			return section == Symbol::EXTERN ? reloc : sections.at(section).key;
 		}
-		return stream;
+	};
+	template <typename Table>
+	with_sections_t<Table> with_sections(const Table& table, const hashvec<Section>& sections) {
+		return { table, sections };
 	}
-	std::ostream& operator<<(std::ostream& stream, const hashvec<Constant>& constants) {
-		stream << "#tabela konstanti\n";
-		stream << "#ime" << '\t' << "vr." << '\t' << "r.b." << '\n';
-		for (const auto& constant : constants) {
-			stream << constant.key << '\t' << constant.value << '\t' << constant.index << '\t' << '\n';
+
+	// Text output is rendered by the same code twice: first into size_sink to get the exact
+	// length, then into buffer_sink over a buffer allocated once with that length.
+	struct size_sink {
+		size_t size = 0;
+		void put(char) { size++; }
+		void put(std::string_view text) { size += text.size(); }
+		void dec(uint value) { size += utils::dec_digits(value); }
+		void hex(uint value, uint width) { size += std::max(width, utils::hex_digits(value)); }
+		void bytes(const uint8_t*, uint length) { size += 3 * (size_t)length; }
+	};
+	struct buffer_sink {
+		char* dst;
+		void put(char c) { *dst++ = c; }
+		void put(std::string_view text) { dst = std::copy(text.begin(), text.end(), dst); }
+		void dec(uint value) { dst = std::to_chars(dst, dst + 10, value).ptr; }
+		// uppercase, zero padded to width
+		void hex(uint value, uint width) {
+			uint digits = std::max(width, utils::hex_digits(value));
+			for (uint i = digits; i-- > 0; value >>= 4)
+				dst[i] = "0123456789ABCDEF"[value & 15];
+			dst += digits;
+		}
+		// "XX " for every byte
+		void bytes(const uint8_t* src, uint length) {
+			for (uint i = 0; i < length; i++, dst += 3) {
+				dst[0] = utils::HEX_PAIRS[src[i] * 2];
+				dst[1] = utils::HEX_PAIRS[src[i] * 2 + 1];
+				dst[2] = ' ';
+			}
+		}
+	};
+
+	template <typename Sink>
+	void render(Sink& out, const with_sections_t<hashvec<Symbol>>& symbols) {
+		out.put("#tabela simbola\n");
+		out.put("#ime\tsek\tvr.\tvid.\tr.b.\n");
+		for (const auto& symbol : symbols.table) {
+			out.put(symbol.key); out.put('\t');
+			out.put(symbols.name(symbol.section)); out.put('\t');
+			out.dec(symbol.offset); out.put('\t');
+			out.put(symbol.isLocal ? "local" : "global"); out.put('\t');
+			out.dec(symbol.index); out.put('\n');
 		}
-		return stream;
 	}
-	std::ostream& operator<<(std::ostream& stream, const hashvec<Section>& sections) {
+	template <typename Sink>
+	void render(Sink& out, const hashvec<Section>& sections) {
 		for (const auto& section : sections) {
 			if (section.counter == 0) continue;
-			stream << "#." << section.key << " (" << section.counter << ")\n";
-			string memdump = section.memdump();
-			for (int i = 0; i + 1 < memdump.length(); i += 2)
-				stream << memdump[i] << memdump[i + 1] << " ";
-			stream << '\n';
+			out.put("#."); out.put(section.key); out.put(" ("); out.dec(section.counter);
+			// nobits sections have no contents, runs are written as XX*count
+			if (section.nobits()) {
+				out.put(") nobits\n");
+				continue;
+			}
+			out.put(")\n");
+			section.visit([&out](const uint8_t* bytes, uint length) {
+				out.bytes(bytes, length);
+			}, [&out](uint8_t value, uint length) {
+				out.hex(value, 2); out.put('*'); out.dec(length); out.put(' ');
+			});
+			out.put('\n');
 		}
-		return stream;
 	}
-	std::ostream& operator<<(std::ostream& stream, const std::vector<Relocation>& relocations) {
-		std::unordered_map<std::string, std::vector<Relocation>> map;
-		for (const auto& relocation : relocations)
-			map[relocation.section].push_back(relocation);
-
-		for (const auto& rel_section : map) {
-			stream << "#.ret." << rel_section.first << '\n';
-			stream << "#ofset" << '\t' << "tip" << "\t\t" << "vr[." << rel_section.first << "]:\t" << '\n';
-			for (const auto& relocation : rel_section.second) {
-				stream << "0x" << std::setfill('0') << std::setw(DWORD_SZ * 2) << std::hex << std::uppercase;
-				stream << relocation.offset << '\t' << (relocation.type == Relocation::reloc_t::R_386_16 ? "R_386_16" : "R_386_PC16") << '\t' << std::dec << relocation.num << '\n';
+	// sections follow the section table order, relocations inside of them offset order
+	template <typename Sink>
+	void render(Sink& out, const with_sections_t<relocation_table>& relocations) {
+		for (uint32_t section = 0; section < relocations.table.sections(); section++) {
+			const auto& group = relocations.table.of(section);
+			if (group.empty()) continue;
+			const string& name = relocations.name(section);
+			out.put("#.ret."); out.put(name); out.put('\n');
+			out.put("#ofset\ttip\t\tvr[."); out.put(name); out.put("]:\t\n");
+			for (const auto& relocation : group) {
+				out.put("0x"); out.hex(relocation.offset, DWORD_SZ * 2); out.put('\t');
+				out.put(relocation.type == Relocation::reloc_t::R_386_16 ? "R_386_16" : "R_386_PC16"); out.put('\t');
+				out.dec(relocation.num); out.put('\n');
 			}
 		}
+	}
+
+	// tables rendered one after another into a single buffer of exact size
+	template <typename... Tables>
+	string render_text(const Tables&... tables) {
+		size_sink size;
+		(render(size, tables), ...);
+		string text(size.size, '\0');
+		buffer_sink out{ text.data() };
+		(render(out, tables), ...);
+		return text;
+	}
 
+	std::ostream& operator<<(std::ostream& stream, const with_sections_t<hashvec<Symbol>>& symbols) {
+		return stream << render_text(symbols);
+	}
+	std::ostream& operator<<(std::ostream& stream, const hashvec<Constant>& constants) {
+		stream << "#tabela konstanti\n";
+		stream << "#ime" << '\t' << "vr." << '\t' << "r.b." << '\n';
+		for (const auto& constant : constants) {
+			stream << constant.key << '\t' << constant.value << '\t' << constant.index << '\t' << '\n';
+		}
 		return stream;
 	}
+	std::ostream& operator<<(std::ostream& stream, const hashvec<Section>& sections) {
+		return stream << render_text(sections);
+	}
+	std::ostream& operator<<(std::ostream& stream, const with_sections_t<relocation_table>& relocations) {
+		return stream << render_text(relocations);
+	}
 }
 
 #endif
\ No newline at end of file
@@ -2,8 +2,12 @@
 #define __ASM_UTILS_H__
 
 #include <string>
+#include <string_view>
+#include <charconv>
+#include <memory>
 #include <algorithm>
 #include <exception>
+#include <array>
 
 namespace ASM {
 	namespace utils {
@@ -15,20 +19,53 @@ namespace ASM {
 			}
 			return count;
 		}
+		// std::stoi for views, converts leading part of the string and throws if there is none
+		int stoi(std::string_view str) {
+			int value = 0;
+			auto result = std::from_chars(str.data(), str.data() + str.size(), value);
+			if (result.ec == std::errc::invalid_argument)
+				throw std::invalid_argument("stoi");
+			if (result.ec == std::errc::result_out_of_range)
+				throw std::out_of_range("stoi");
+			return value;
+		}
 		// converts string to integer with addition that if string contains a single char it will convert accordingly
-		uint16_t sctoi(const std::string& str) {
-			try {
-				return std::stoi(str);
+		uint16_t sctoi(std::string_view str) {
+			int value = 0;
+			auto result = std::from_chars(str.data(), str.data() + str.size(), value);
+			if (result.ec == std::errc::result_out_of_range)
+				throw std::out_of_range("stoi");
+			if (result.ec != std::errc::invalid_argument)
+				return value;
+			// chars are checked without throwing, they are common in data directives
+			if (str.length() == 1 && std::isalpha(str[0]))
+				return str[0];
+			else if (str == "\\n") return '\n';
+			else if (str == "\\t") return '\t';
+			else throw std::invalid_argument("stoi");
+		}
+		// uppercase hex digit pairs of every byte value, indexed by byte * 2
+		static constexpr auto HEX_PAIRS = [] {
+			std::array<char, 512> pairs{};
+			for (int i = 0; i < 256; i++) {
+				pairs[i * 2] = "0123456789ABCDEF"[i >> 4];
+				pairs[i * 2 + 1] = "0123456789ABCDEF"[i & 15];
 			}
-			catch (std::invalid_argument& exception) {
-				if (str.length() == 1 && std::isalpha(str[0]))
-					return str[0];
-				else if (str == "\\n") return '\n';
-				else if (str == "\\t") return '\t';
-				else throw exception;
+			return pairs;
+		}();
+		inline unsigned int dec_digits(unsigned int num) {
+			unsigned int count = 1;
+			while (num >= 10) {
+				num /= 10;
+				count++;
 			}
+			return count;
+		}
+		inline unsigned int hex_digits(unsigned int num) {
+			return std::max((bitsize(num) + 3) / 4, 1);
 		}
-		std::string tolower(std::string str) {
+		std::string tolower(std::string_view view) {
+			std::string str(view);
 			std::transform(str.begin(), str.end(), str.begin(), ::tolower);
 			return str;
 		}
@@ -7,13 +7,23 @@
 */
 
 #define CATCH_CONFIG_RUNNER
+#define CATCH_CONFIG_NO_POSIX_SIGNALS
 #include "cxxopts.hpp"
 #include "catch.hpp"
 #include "asm.h"
 
+#include <chrono>
+#include <random>
+#include <atomic>
+#include <new>
+#include <thread>
 #include <experimental/filesystem>
+#include <sys/wait.h>
 namespace fs = std::experimental::filesystem;
 
+using string = std::string;
+string tests_path = "tests";
+
 bool compareFiles(const std::string& p1, const std::string& p2) {
 	std::ifstream f1(p1, std::ifstream::binary | std::ifstream::ate);
 	std::ifstream f2(p2, std::ifstream::binary | std::ifstream::ate);
@@ -34,6 +44,48 @@ bool compareFiles(const std::string& p1, const std::string& p2) {
 		std::istreambuf_iterator<char>(f2.rdbuf()));
 }
 
+#ifdef ASM_COUNT_ALLOCATIONS
+// General heap allocations, reported by --stats. Counting costs an atomic increment on every
+// allocation, so only the binary built with make stats replaces the global operators.
+static std::atomic<size_t> allocations{ 0 };
+
+static void* counted_malloc(std::size_t size, std::size_t alignment = alignof(std::max_align_t)) noexcept {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	size = size ? size : 1;
+	if (alignment <= alignof(std::max_align_t))
+		return std::malloc(size);
+	return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+static void* counted_new(std::size_t size, std::size_t alignment = alignof(std::max_align_t)) {
+	if (void* ptr = counted_malloc(size, alignment))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size) { return counted_new(size); }
+void* operator new[](std::size_t size) { return counted_new(size); }
+void* operator new(std::size_t size, std::align_val_t alignment) { return counted_new(size, (std::size_t)alignment); }
+void* operator new[](std::size_t size, std::align_val_t alignment) { return counted_new(size, (std::size_t)alignment); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return counted_malloc(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return counted_malloc(size); }
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return counted_malloc(size, (std::size_t)alignment); }
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return counted_malloc(size, (std::size_t)alignment); }
+
+// malloc and aligned_alloc memory are both released with free
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { std::free(ptr); }
+#endif
+
 static const ASM::parser get_parser(ASM::flags_t type) {
 	for (auto& parser : ASM::parsers) {
 		if (parser.flags & type)
@@ -42,6 +94,25 @@ static const ASM::parser get_parser(ASM::flags_t type) {
 	throw std::runtime_error("Fatal error! Parser not defined");
 }
 
+// Assembles source held in memory on an assembler of its own. The pass trace goes to log and the
+// object stays in memory, so a failing assertion leaves no redirected output or files behind.
+// Relative .incbin paths are taken from the working directory.
+struct test_assembly {
+	std::ostringstream log;
+	ASM::Assembler assembler;
+	string object;
+	ASM::hashvec<ASM::Section>& sections = assembler.sections;
+	ASM::hashvec<ASM::Symbol>& symtable = assembler.symtable;
+	ASM::relocation_table& relocations = assembler.relocations;
+
+	explicit test_assembly(const string& source, ASM::parser_engine engine = ASM::parser_engine::LEXER,
+		ASM::object_format format = ASM::object_format::TEXT) : assembler("test.s", "test.o", engine, format) {
+		assembler.log = &log;
+		object = assembler.build(ASM::source_file(ASM::source_file::in_memory, source));
+	}
+	test_assembly(const test_assembly&) = delete;
+};
+
 TEST_CASE("REGEX check") {
 	using namespace ASM;
 
@@ -74,21 +145,42 @@ TEST_CASE("REGEX check") {
 		std::remove("testfile");
 	}
 
-	SECTION("Checking if parser recursion works properly") {
-		parsed_t data = get_parser(ALLOC).parse(".byte 1,2 ,3,4,  5, 6");
+	SECTION("Checking if data lists are captured whole") {
+		parsed_t data = get_parser(ALLOC).parse(".byte 1,2 ,3,4,  5, 6 ");
 		REQUIRE(data.values[0] == "byte");
-		REQUIRE(data.values[1] == "1");
-		REQUIRE(data.values[2] == "2");
-		REQUIRE(data.values[3] == "3");
-		REQUIRE(data.values[4] == "4");
-		REQUIRE(data.values[5] == "5");
-		REQUIRE(data.values[6] == "6");
+		REQUIRE(data.values[1] == "1,2 ,3,4,  5, 6");
+		REQUIRE(data.values[2] == " ");
+
+		vector<token> elements;
+		for_each_numchar(data.values[1], [&elements](token value) { elements.push_back(value); });
+		REQUIRE(elements == vector<token>{ "1", "2", "3", "4", "5", "6" });
+		REQUIRE(numchar_count(data.values[1]) == 6);
 	}
 
 	SECTION("Checking NUMCHAR parsing") {
 		parsed_t data = get_parser(ALLOC).parse(".byte 'W', 'O', 'R', 'D', '\\n'");
-		REQUIRE(data.values[1] == "W");
-		REQUIRE(data.values[5] == "\\n");
+		vector<token> elements;
+		for_each_numchar(data.values[1], [&elements](token value) { elements.push_back(value); });
+		REQUIRE(elements == vector<token>{ "W", "O", "R", "D", "\\n" });
+	}
+
+	SECTION("Checking long data lists") {
+		string line = ".word 1";
+		for (int i = 0; i < 5000; i++)
+			line += ", 'x'";
+		vector<parsed_t> data;
+		REQUIRE(lexer::lex(line, data).empty());
+		REQUIRE(numchar_count(data[0].values[1]) == 5001);
+
+		Section section;
+		section.dwords.generate(numchar_count(data[0].values[1]), [&](auto&& emit) {
+			for_each_numchar(data[0].values[1], [&](token value) { emit(utils::sctoi(value)); });
+		});
+		REQUIRE(section.counter == 5001 * DWORD_SZ);
+		REQUIRE(section.read<uint16_t>(5000 * DWORD_SZ) == 'x');
+		REQUIRE_THROWS_AS(section.words.generate(2, [](auto&& emit) { emit(1); emit(256); }), std::overflow_error);
+		REQUIRE(section.counter == 5001 * DWORD_SZ);
+		REQUIRE(section.size() == 5001 * DWORD_SZ);
 	}
 
 	SECTION("Checking skip/align") {
@@ -125,6 +217,297 @@ TEST_CASE("REGEX check") {
 ;	}
 }
 
+TEST_CASE("Tokens are views into the source") {
+	using namespace ASM;
+	std::ofstream testfile("testfile", std::ios::out | std::ios::trunc);
+	testfile << "label1: movw r1[12], 5\n.byte 1,2,3,4,5,6,7,8,9,10\n";
+	testfile.close();
+
+	source_file source("testfile");
+	auto inside = [&source](token value) {
+		return value.data() >= source.view().data() && value.data() + value.size() <= source.view().data() + source.view().size();
+	};
+	for (auto engine : { parser_engine::LEXER, parser_engine::REGEX }) {
+		for (source_iterator iter(source, engine); iter != EOF; ++iter) {
+			REQUIRE(inside(iter->line));
+			for (auto& data : iter->data)
+				REQUIRE(std::all_of(data.values.begin(), data.values.end(), inside));
+		}
+	}
+	std::remove("testfile");
+}
+
+TEST_CASE("Source file mapping") {
+	using namespace ASM;
+	std::ofstream testfile("testfile", std::ios::out | std::ios::trunc);
+	testfile << string(1000000, '\n') << "last: ret";
+	testfile.close();
+
+	source_file source("testfile");
+	REQUIRE(source.mapped());
+
+	// long runs of blank lines must not recurse
+	int lines = 0;
+	for (source_iterator iter(source); iter != EOF; ++iter, ++lines) {
+		REQUIRE(iter->line_num == 1000001);
+		REQUIRE(iter->data[0].values[0] == "last");
+	}
+	REQUIRE(lines == 1);
+	std::remove("testfile");
+}
+
+TEST_CASE("Recorded program") {
+	using namespace ASM;
+	std::ofstream testfile("testfile", std::ios::out | std::ios::trunc);
+	testfile << ".data\nnum: .word 5\n\n.text\nstart: push r1[5]\n\tcall $start\n";
+	testfile.close();
+
+	init("testfile", "testfile.o");
+	source_file source("testfile");
+	arena memory;
+	program recording(memory);
+	auto log = std::cout.rdbuf(nullptr);
+	FirstPass{ assembler }.process(source, recording);
+	std::cout.rdbuf(log);
+	std::cout.clear();
+
+	REQUIRE(recording.size() == 5);
+	REQUIRE(recording[1].line_num == 2);
+	REQUIRE(recording[1].section == "data");
+	REQUIRE(recording.end(recording[1]) - recording.begin(recording[1]) == 2);
+	REQUIRE(recording.begin(recording[1])[1].values[1] == "5");
+	REQUIRE(recording[3].section == "text");
+
+	// first pass decisions are kept for replay
+	const parsed_t& push = recording.begin(recording[3])[1];
+	REQUIRE(push.instr.operands[0].mode == operand_t::REGIND8);
+	std::remove("testfile");
+}
+
+TEST_CASE("Included binary files") {
+	using namespace ASM;
+	{
+		std::ofstream blob("testblob.bin", std::ios::out | std::ios::binary | std::ios::trunc);
+		for (int i = 0; i < 256; i++)
+			blob.put((char)i);
+	}
+	for (auto engine : { parser_engine::LEXER, parser_engine::REGEX }) {
+		test_assembly run(".data\n.incbin \"testblob.bin\", 16, 4\nafter: .byte 1\n.INCBIN \"testblob.bin\"\n.incbin \"testblob.bin\", 250\n", engine);
+		Section& data = run.sections["data"];
+		REQUIRE(data.counter == 4 + 1 + 256 + 6);
+		REQUIRE(run.symtable["after"].offset == 4);
+		REQUIRE(data.read<uint8_t>(0) == 16);
+		REQUIRE(data.read<uint8_t>(3) == 19);
+		REQUIRE(data.read<uint8_t>(4) == 1);
+		REQUIRE(data.read<uint8_t>(5 + 255) == 255);
+		REQUIRE(data.read<uint8_t>(261) == 250);
+	}
+
+	vector<parsed_t> parsed;
+	lexer::lex(".incbin \"testblob.bin\", 300", parsed);
+	REQUIRE_THROWS_AS(incbin_range(parsed[0], "testfile"), syntax_error);
+	std::remove("testblob.bin");
+}
+
+TEST_CASE("String directives") {
+	using namespace ASM;
+	for (auto engine : { parser_engine::LEXER, parser_engine::REGEX }) {
+		test_assembly run(".data\nmsg: .ascii \"Hi\\n\"\nz: .asciz \"a\", \"b\\\"c\\0\"\nend: .byte 7\n", engine);
+		REQUIRE(run.symtable["z"].offset == 3);
+		REQUIRE(run.symtable["end"].offset == 3 + 2 + 5);
+		REQUIRE(run.sections["data"].memdump() == "48690A" "6100" "62226300" "00" "07");
+	}
+}
+
+TEST_CASE("Uninitialized and repeated data") {
+	using namespace ASM;
+	test_assembly run(".bss\nbuffer: .skip 1000000\nsmall: .skip 2\n.data\n.byte 1\n.skip 32, 255\n.skip 2, 7\nafter: .word 35\n");
+	REQUIRE(run.sections["bss"].nobits());
+	REQUIRE(run.sections["bss"].size() == 1000002);
+	REQUIRE(run.symtable["after"].offset == 35);
+	REQUIRE(run.object.find("#.bss (1000002) nobits\n#.data (37)\n01 FF*32 07 07 23 00 \n") != string::npos);
+
+	// section directives are icase, so is the name that makes a section uninitialized
+	test_assembly upper(".BSS\nbuffer: .skip 100\n");
+	REQUIRE(upper.sections[0].nobits());
+}
+
+TEST_CASE("Binary object format") {
+	using namespace ASM;
+	auto read_file = [](const string& path) {
+		std::ifstream file(path, std::ios::in | std::ios::binary);
+		std::stringstream contents;
+		contents << file.rdbuf();
+		return contents.str();
+	};
+	auto text_of = [](std::string_view contents) {
+		object_t object = load_object(contents);
+		return render_text(object.sections, object.symtable, object.relocations);
+	};
+
+	SECTION("golden objects convert both ways") {
+		std::set<string> set;
+		for (const auto& entry : fs::directory_iterator(tests_path))
+			set.emplace(entry.path().filename().replace_extension(""));
+		for (auto& name : set) {
+			string golden = read_file(tests_path + "/" + name + ".o");
+			object_t text = load_object(golden);
+			REQUIRE(text_of(render_binary(text.sections, text.symtable, text.relocations)) == golden);
+
+			test_assembly run(read_file(tests_path + "/" + name + ".s"), parser_engine::LEXER, object_format::BINARY);
+			REQUIRE(text_of(run.object) == golden);
+		}
+	}
+	SECTION("mapped file is used in place") {
+		object_t text = load_object(read_file(tests_path + "/test.o"));
+		string binary = render_binary(text.sections, text.symtable, text.relocations);
+		object::view file(binary.data(), binary.size());
+
+		REQUIRE(file.sections().size() == 1);
+		const object::section_t& section = file.sections()[0];
+		REQUIRE(file.name(section.name) == "text");
+		REQUIRE(section.size == 13);
+		REQUIRE(file.data(section)[0] == 0x24);
+		REQUIRE(file.relocations(section).size() == 2);
+		REQUIRE(file.relocations(section)[1].offset == 0x0B - 0x07); // delta encoded
+		vector<uint64_t> offsets;
+		file.sweep(section, [&offsets](uint64_t offset, const object::relocation_t&) { offsets.push_back(offset); });
+		REQUIRE(offsets == vector<uint64_t>{ 0x07, 0x0B });
+		REQUIRE(file.name(file.symbols()[file.relocations(section)[0].symbol].name) == "printf");
+		REQUIRE(file.symbols()[1].section == Symbol::EXTERN);
+
+		REQUIRE_THROWS(object::view(binary.data(), binary.size() - 4));
+		binary[sizeof(object::header_t)] = 0x7F; // name of the first section past the string table
+		REQUIRE_THROWS(object::view(binary.data(), binary.size()));
+	}
+	SECTION("runs are kept as records and nobits keep only their size") {
+		test_assembly run(".bss\nbuffer: .skip 1000\n.data\n.byte 1\n.skip 5000, 255\n.byte 2\n", parser_engine::LEXER, object_format::BINARY);
+		const string& binary = run.object;
+		REQUIRE(binary.size() < 1000);
+		object::view file(binary.data(), binary.size());
+		REQUIRE(file.sections()[0].flags == (object::section_t::BSS | object::section_t::NOBITS));
+		REQUIRE(file.sections()[0].size == 1000);
+		const object::section_t& data = file.sections()[1];
+		REQUIRE(data.size == 5002);
+		REQUIRE(data.stored == 2);
+		REQUIRE(file.data(data)[1] == 0x02);
+		REQUIRE(file.runs(data).size() == 1);
+		REQUIRE(file.runs(data)[0].offset == 1);
+		REQUIRE(file.runs(data)[0].length == 5000);
+		REQUIRE(file.runs(data)[0].value == 0xFF);
+
+		string text = text_of(binary);
+		REQUIRE(text.find("#.bss (1000) nobits\n#.data (5002)\n01 FF*5000 02") != string::npos);
+		object_t loaded = load_object(text);
+		REQUIRE(render_binary(loaded.sections, loaded.symtable, loaded.relocations) == binary);
+	}
+}
+
+TEST_CASE("Arena allocation") {
+	using namespace ASM;
+	arena memory;
+	char* byte = static_cast<char*>(memory.allocate(1, 1));
+	uint64_t* aligned = static_cast<uint64_t*>(memory.allocate(sizeof(uint64_t), alignof(uint64_t)));
+	REQUIRE((uintptr_t)aligned % alignof(uint64_t) == 0);
+	REQUIRE((char*)aligned > byte);
+	REQUIRE(memory.size() == 64 * 1024);
+
+	memory.allocate(1 << 20); // larger than a block
+	REQUIRE(memory.size() > (1 << 20));
+
+	std::vector<int, arena_allocator<int>> numbers(memory);
+	for (int i = 0; i < 1000; i++)
+		numbers.push_back(i);
+	REQUIRE(numbers[999] == 999);
+	numbers = std::vector<int, arena_allocator<int>>(memory);
+
+	memory.release();
+	REQUIRE(memory.size() == 0);
+}
+
+TEST_CASE("Symbols refer to sections by id") {
+	using namespace ASM;
+	std::ofstream testfile("testfile", std::ios::out | std::ios::trunc);
+	testfile << ".data\nnum: .word 5\n.text\nstart: push num\n\tcall $start\n\tcall $ext\n";
+	testfile.close();
+
+	init("testfile", "testfile.o");
+	auto log = std::cout.rdbuf(nullptr);
+	assemble();
+	std::cout.rdbuf(log);
+	std::cout.clear();
+
+	REQUIRE(sections[symtable["num"].section].key == "data");
+	REQUIRE(sections[symtable["start"].section].key == "text");
+	REQUIRE(symtable["ext"].section == Symbol::EXTERN);
+	REQUIRE(relocations.size() == 1);
+	REQUIRE(relocations.of(sections["text"].index).size() == 1);
+	REQUIRE(relocations.of(sections["text"].index)[0].num == symtable["ext"].index);
+
+	std::ostringstream listing;
+	listing << with_sections(symtable, sections);
+	REQUIRE(listing.str().find("ext\tRELOC\t") != string::npos);
+	std::remove("testfile");
+	std::remove("testfile.o");
+}
+
+TEST_CASE("Relocation tables") {
+	using namespace ASM;
+	relocation_table table;
+	table.add(Relocation{ 1, 9, 0, Relocation::R_386_16 });
+	table.add(Relocation{ 1, 3, 1, Relocation::R_386_16 });
+	table.add(Relocation{ 0, 5, 2, Relocation::R_386_PC16 });
+	table.add(Relocation{ 1, 6, 3, Relocation::R_386_16 });
+	REQUIRE(table.size() == 4);
+	REQUIRE(table.sections() == 2);
+	vector<uint> offsets;
+	for (auto& relocation : table.of(1))
+		offsets.push_back(relocation.offset);
+	REQUIRE(offsets == vector<uint>{ 3, 6, 9 });
+	REQUIRE(table.of(7).empty());
+
+	test_assembly run(".section \".zeta\"\ncall $f\npush h\n.section \".alpha\"\ncall $g\n");
+	// groups follow the section table, not the names
+	string text = render_text(with_sections(run.relocations, run.sections));
+	REQUIRE(text.find("#.ret.zeta") < text.find("#.ret.alpha"));
+	REQUIRE(run.relocations.of(run.sections["zeta"].index).size() == 2);
+}
+
+TEST_CASE("Instruction encoding") {
+	using namespace ASM;
+	arena memory;
+	interner names{ memory };
+	auto decode_line = [&names](const char* line) {
+		vector<parsed_t> data;
+		lexer::lex(line, data);
+		return decode(data[0], names);
+	};
+
+	instruction_t instr = decode_line("movw r3, 3560");
+	REQUIRE(instr.count == 2);
+	REQUIRE(instr.size == DWORD_SZ);
+	REQUIRE(instr.operands[0].mode == operand_t::REGDIR);
+	REQUIRE(instr.operands[0].reg == 3);
+	REQUIRE(instr.operands[1].value == 3560);
+
+	Section section;
+	encode(instr, section, [](const operand_t&, int, uint) -> uint16_t { throw std::logic_error("no symbols"); });
+	REQUIRE(section.memdump() == "242600E80D");
+	REQUIRE(instruction_size(instr) == section.counter);
+
+	instr = decode_line("push r1h[test]");
+	REQUIRE(instr.operands[0].mode == operand_t::REGIND16);
+	REQUIRE(instr.operands[0].symbol == operand_t::ABS);
+	REQUIRE(instr.operands[0].high);
+	REQUIRE(names[instr.operands[0].name] == "test");
+
+	Section resolved;
+	encode(instr, resolved, [](const operand_t& op, int op_sz, uint) -> uint16_t { return op_sz == DWORD_SZ ? 0x1234 : 0; });
+	REQUIRE(resolved.memdump() == "8C833412");
+
+	REQUIRE_THROWS_AS(decode_line("mov ax, 99999999999"), syntax_error);
+}
+
 TEST_CASE("HasVec structure check") {
 	using namespace ASM;
 	hashvec<std::string> symtable;
@@ -141,9 +524,66 @@ TEST_CASE("HasVec structure check") {
 
 	REQUIRE(symtable[1].key == "milenko");
 	REQUIRE(symtable["milenko"].index == 1);
+	REQUIRE(!symtable.has("Milenko"));
+	REQUIRE(!symtable.has("milenk"));
+
+	// growing keeps indices and insertion order
+	for (int i = 0; i < 1000; i++)
+		symtable.put("sym" + std::to_string(i), std::to_string(i));
+	REQUIRE(symtable.size() == 1002);
+	REQUIRE(symtable["sym777"].index == 779);
+	REQUIRE(symtable[779] == "777");
+	REQUIRE(symtable.size() == 1002);
+
+	// lookups in icase tables don't depend on case
+	REQUIRE(optable.has("MoV"));
+	REQUIRE(optable.at("PUSH").index == optable.at("push").index);
+	REQUIRE(optable.at("push").key == "push");
+
+	REQUIRE((optable.at("mov").flags & E) == E);
+	REQUIRE((optable.at("jne").flags & E) == 0);
+}
+
+// payload that counts how often it was copied
+struct copy_counter {
+	static int copies;
+	int value = 0;
+	copy_counter(int value = 0) : value(value) {}
+	copy_counter(const copy_counter& rhs) : value(rhs.value) { copies++; }
+	copy_counter(copy_counter&&) = default;
+	copy_counter& operator=(const copy_counter& rhs) { value = rhs.value; copies++; return *this; }
+	copy_counter& operator=(copy_counter&&) = default;
+};
+int copy_counter::copies = 0;
+
+TEST_CASE("HashVec inserts without copies") {
+	using namespace ASM;
+	copy_counter::copies = 0;
+	hashvec<copy_counter> table;
+	for (int i = 0; i < 1000; i++) // growing moves entries
+		table.emplace("e" + std::to_string(i), i);
+	table.put("moved", copy_counter{ 5 });
+	table["default"].value = 7;
+	REQUIRE(table.size() == 1002);
+	REQUIRE(table["e999"].value == 999);
+	REQUIRE(table["moved"].value == 5);
+	REQUIRE(copy_counter::copies == 0);
 
-	REQUIRE((optable["mov"].flags & E) == E);
-	REQUIRE((optable["jne"].flags & E) == 0);
+	hashvec<copy_counter> moved = std::move(table);
+	REQUIRE(moved["e10"].value == 10);
+	REQUIRE(copy_counter::copies == 0);
+
+	// sections are moved together with their storage, streams follow the new owner
+	hashvec<Section> sections;
+	auto& first = sections.emplace("text");
+	first.counter = 2;
+	first.allocate();
+	for (int i = 0; i < 100; i++)
+		sections.emplace("s" + std::to_string(i));
+	sections["text"].dwords << 0x0A0B;
+	REQUIRE(sections["text"].memdump() == "0B0A");
+	REQUIRE(std::is_nothrow_move_constructible_v<Section>);
+	REQUIRE(!std::is_copy_constructible_v<Section>);
 }
 
 TEST_CASE("Address mask chekcs") {
@@ -172,6 +612,79 @@ TEST_CASE("Stream test") {
 	}
 
 
+	SECTION("Checking typed access") {
+		Section test;
+		test.bytes << 0xAD;
+		test.dwords << 0x0A0B;
+
+		REQUIRE(test.read<uint8_t>(0) == 0xAD);
+		REQUIRE(test.read<uint16_t>(1) == 0x0A0B);
+		REQUIRE(test.peek(1, WORD_SZ) == 0x0B);
+		REQUIRE(!test.peek(2, DWORD_SZ));
+		REQUIRE_THROWS_AS(test.read<uint16_t>(2), std::out_of_range);
+
+		test.patch<uint16_t>(0, 0x1234);
+		REQUIRE(test.memdump() == "34120A");
+	}
+
+	SECTION("Checking preallocated sections") {
+		Section test;
+		test.counter = 4; // as counted by first pass
+		test.allocate();
+		REQUIRE(test.size() == 4);
+		REQUIRE(test.counter == 0);
+
+		test.dwords << 0x0A0B;
+		REQUIRE(test.size() == 4);
+		REQUIRE(test.read<uint16_t>(0) == 0x0A0B);
+		REQUIRE(!test.peek(2, DWORD_SZ)); // allocated but not written yet
+		REQUIRE(test.counter != test.size());
+	}
+
+	SECTION("Checking bulk writes") {
+		Section test;
+		test.bytes.fill(0xFF, 3);
+		test.dwords.fill(0x0102, 2);
+		REQUIRE(test.memdump() == "FFFFFF02010201");
+
+		int values[] = { 1, 2, 0x0A0B };
+		test.dwords.write(values, values + 3);
+		REQUIRE(test.counter == 13);
+		REQUIRE(test.read<uint16_t>(11) == 0x0A0B);
+		REQUIRE_THROWS_AS(test.bytes.write(values, values + 3), std::overflow_error);
+		REQUIRE(test.counter == 13); // nothing written when a value doesn't fit
+
+		const uint8_t raw[] = { 0xDE, 0xAD };
+		test.write(raw, 2);
+		REQUIRE(test.memdump().substr(26) == "DEAD");
+	}
+
+	SECTION("Checking runs") {
+		Section test;
+		test.counter = 2;
+		test.reserve_run(20, 0xAB);
+		test.counter += 1;
+		test.reserve_run(4, 0); // short ones only when asked for
+		test.allocate();
+		REQUIRE(test.size() == 27);
+
+		test.dwords << 0x0102;
+		test.skip_run(20);
+		test.bytes << 0xCD;
+		test.skip_run(4);
+		REQUIRE(test.counter == test.size());
+		string expected = "0201";
+		for (int i = 0; i < 20; i++)
+			expected += "AB";
+		REQUIRE(test.memdump() == expected + "CD00000000");
+		REQUIRE(test.peek(1, DWORD_SZ) == 0xAB01);
+		REQUIRE(test.read<uint8_t>(22) == 0xCD);
+		REQUIRE_THROWS_AS(test.patch<uint16_t>(21, 0), std::out_of_range);
+		test.patch<uint8_t>(22, 0xEF);
+		REQUIRE(test.read<uint16_t>(22) == 0x00EF);
+		REQUIRE_THROWS_AS(test.skip_run(1), std::logic_error);
+	}
+
 	SECTION("Checking if works with HashVec") {
 		sections.put("test", Section{});
 		auto& test = sections["test"];
@@ -186,8 +699,176 @@ TEST_CASE("Stream test") {
 
 }
 
-using string = std::string;
-string tests_path = "tests";
+// representative source lines used to generate synthetic inputs for benchmarks
+static const char* corpus_lines[] = {
+	"label%d: mov ax, bp",
+	"\tmovw r3, 3560",
+	"\tpush *1233",
+	"\tcall $printf",
+	"\tmovw [r7][test]",
+	"\tpush r1[5]",
+	"\tadd b,c",
+	"\tcmp ax, 'A'",
+	"\t.byte 1,2 ,3,4,  5, 6",
+	"\t.byte 'W', 'O', 'R', 'D', '\\n'",
+	"\t.skip 4,8",
+	"",
+	"\tret"
+};
+
+static int write_corpus(const string& path, int lines) {
+	std::ofstream out(path, std::ios::out | std::ios::trunc);
+	constexpr int n = sizeof(corpus_lines) / sizeof(*corpus_lines);
+	out << ".text\n";
+	for (int i = 1; i < lines; i++)
+		out << ASM::utils::string_format(corpus_lines[i % n], i) << '\n';
+	return lines;
+}
+
+template <typename F>
+static void report_rate(const string& name, size_t items, const char* unit, F&& fn) {
+	auto start = std::chrono::steady_clock::now();
+	fn();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << name << ": " << items << ' ' << unit << " in " << elapsed.count() * 1000 << " ms ("
+		<< (size_t)(items / elapsed.count()) << ' ' << unit << "/s)\n";
+}
+
+// random source line built from grammar fragments, including odd but accepted spellings
+static string random_line(std::mt19937& rng) {
+	static const std::vector<string> mnemonics = { "halt", "xchg", "int", "mov", "ADD", "sub", "mul", "div", "cmp", "not", "and", "or", "xor", "test", "shl", "shr", "push", "pop", "jmp", "jeq", "jne", "jgt", "call", "ret", "iret", "nop", "Movw", "addw" };
+	static const std::vector<string> operands = { "ax", "SP", "bp", "pc", "r0", "r7", "r8", "r3h", "r2l", "[r4]", "[ ax ]", "[r1]h", "r7[12]", "r1[sym]", "[r7][test]", "*1233", "*9",
+		"5", "65535", "'A'", "'\\n'", "label", "label1", "$printf", "&data", "x.data", "bx", "spam", "'a' 5", "" };
+	static const std::vector<string> directives = { ".byte 1,2 ,3,4,  5, 6", ".word 'W', 'O', '\\t'", ".dword 7", ".BYTE 1, x", ".skip 4,8", ".skip 2", ".align 4", ".align 2, 0",
+		".section \".rodata\"", ".section \".text\"", ".section .text", ".data", ".TEXT", ".bss", ".global f", ".globl main", ".extern a,b,c", ".extern a, b",
+		".equ a, 76", ".equ b,3378", ".end", ".word", ".foo 5",
+		".ascii \"Hi\\n\"", ".asciz \"a\", \"b\\\"c\"", ".ascii \"bad\\q\"", ".ASCIZ \"\"", ".asciz \"x.data\" ,\"\\T\"", ".ascii 'a'" };
+	auto pick = [&rng](const std::vector<string>& from) -> const string& { return from[rng() % from.size()]; };
+	auto space = [&rng]() -> string { return string(rng() % 3, rng() % 2 ? ' ' : '\t'); };
+
+	string line = space();
+	if (rng() % 3 == 0)
+		line += "l" + std::to_string(rng() % 100) + ":" + space();
+	switch (rng() % 3) {
+	case 0: line += pick(directives); break;
+	case 1: line += pick(mnemonics) + space() + pick(operands); break;
+	case 2: line += pick(mnemonics) + space() + pick(operands) + space() + "," + space() + pick(operands); break;
+	}
+	return line + space();
+}
+
+TEST_CASE("Lexer matches regex parser") {
+	using namespace ASM;
+	vector<string> lines;
+	for (const auto& entry : fs::directory_iterator(tests_path)) {
+		if (entry.path().extension() != ".s") continue;
+		std::ifstream source(entry.path());
+		for (string line; std::getline(source, line);)
+			lines.push_back(line);
+	}
+	std::mt19937 rng(1337);
+	for (int i = 0; i < 20000; i++)
+		lines.push_back(random_line(rng));
+
+	for (auto& line : lines) {
+		INFO("line: " << line);
+		vector<parsed_t> expected, actual;
+		REQUIRE(parse_line(line, expected) == lexer::lex(line, actual));
+		REQUIRE(expected.size() == actual.size());
+		for (size_t i = 0; i < expected.size(); i++) {
+			REQUIRE(expected[i].flags == actual[i].flags);
+			REQUIRE(expected[i].values == actual[i].values);
+		}
+	}
+}
+
+TEST_CASE("Parser throughput", "[.][benchmark]") {
+	using namespace ASM;
+	int lines = write_corpus("bench.s", 20000);
+
+	report_rate("source_iterator (regex)", lines, "lines", [] {
+		for (source_iterator iter("bench.s", parser_engine::REGEX); iter != EOF; ++iter);
+	});
+	report_rate("source_iterator (lexer)", lines, "lines", [] {
+		for (source_iterator iter("bench.s", parser_engine::LEXER); iter != EOF; ++iter);
+	});
+
+	report_rate("assemble", lines, "lines", [] {
+		auto log = std::cout.rdbuf(nullptr); // pass logs are not part of the measurement
+		init("bench.s", "bench.o");
+		assemble();
+		std::cout.rdbuf(log);
+		std::cout.clear();
+	});
+	std::remove("bench.o");
+
+	std::remove("bench.s");
+}
+
+TEST_CASE("Symbol table throughput", "[.][benchmark]") {
+	using namespace ASM;
+	constexpr int symbols = 100000;
+	std::vector<string> keys;
+	for (int i = 0; i < symbols; i++)
+		keys.push_back("symbol_" + std::to_string(i));
+
+	hashvec<Symbol> table;
+	report_rate("hashvec insert", symbols, "keys", [&] {
+		for (auto& key : keys)
+			table[key] = Symbol{ 0, 0 };
+	});
+	size_t found = 0;
+	report_rate("hashvec lookup", symbols * 10, "keys", [&] {
+		for (int round = 0; round < 10; round++)
+			for (auto& key : keys)
+				found += table.has(key);
+	});
+	REQUIRE(found == symbols * 10);
+	report_rate("optable lookup (icase)", symbols * 10, "keys", [&] {
+		static const char* mnemonics[] = { "MOV", "push", "Call", "ret", "addw", "jeq" };
+		for (int i = 0; i < symbols * 10; i++)
+			found += optable.has(mnemonics[i % 6]);
+	});
+
+	// every line defines a label and references both a defined and an undefined one
+	{
+		std::ofstream out("bench.s", std::ios::out | std::ios::trunc);
+		out << ".text\n";
+		for (int i = 1; i < 20000; i++)
+			out << "s" << i << ": call $s" << i - 1 << "\n\tpush f" << i << "\n";
+	}
+	report_rate("assemble (symbol heavy)", 40000, "lines", [] {
+		auto log = std::cout.rdbuf(nullptr);
+		init("bench.s", "bench.o");
+		assemble();
+		std::cout.rdbuf(log);
+		std::cout.clear();
+	});
+	std::remove("bench.o");
+	std::remove("bench.s");
+}
+
+TEST_CASE("Object writer throughput", "[.][benchmark]") {
+	using namespace ASM;
+	constexpr int bytes = 8 * 1024 * 1024;
+	std::mt19937 random(7);
+	vector<uint8_t> contents(bytes);
+	for (auto& byte : contents)
+		byte = random();
+
+	hashvec<Section> table;
+	table.emplace("data").write(contents.data(), bytes);
+	hashvec<Symbol> symbols;
+	relocation_table relocations;
+	size_t size = 0;
+	report_rate("render text", bytes, "bytes", [&] {
+		size = render_text(table, symbols, relocations).size();
+	});
+	REQUIRE(size == string("#.data (8388608)\n").size() + bytes * 3 + 1 + string("#tabela simbola\n#ime\tsek\tvr.\tvid.\tr.b.\n").size());
+	report_rate("render binary", bytes, "bytes", [&] {
+		size = render_binary(table, symbols, relocations).size();
+	});
+}
 
 TEST_CASE("Running testfiles") {
 	std::set<string> set;
@@ -202,6 +883,443 @@ TEST_CASE("Running testfiles") {
 	}
 }
 
+TEST_CASE("Running testfiles concurrently") {
+	std::vector<string> names;
+	for (const auto& entry : fs::directory_iterator(tests_path))
+		if (entry.path().extension() == ".s")
+			names.push_back(entry.path().filename().replace_extension(""));
+
+	// every file is assembled several times at once, each by its own instance
+	constexpr int copies = 4;
+	std::vector<std::thread> threads;
+	std::vector<char> matches(names.size() * copies, false);
+	std::vector<std::ostringstream> logs(names.size() * copies);
+	for (size_t i = 0; i < matches.size(); i++) {
+		threads.emplace_back([&, i] {
+			const string& name = names[i / copies];
+			string output = "concurrent" + std::to_string(i) + ".o";
+			ASM::Assembler assembler(tests_path + "/" + name + ".s", output);
+			assembler.log = &logs[i];
+			assembler.assemble();
+			matches[i] = compareFiles(output, tests_path + "/" + name + ".o");
+			std::remove(output.c_str());
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+	for (size_t i = 0; i < matches.size(); i++) {
+		INFO(names[i / copies]);
+		REQUIRE(matches[i]);
+		REQUIRE(logs[i].str() == logs[i - i % copies].str());
+	}
+}
+
+TEST_CASE("Thread pool") {
+	using namespace ASM;
+	std::vector<int> order;
+	{
+		thread_pool pool(1);
+		for (int i = 0; i < 100; i++)
+			pool.submit([&order, i] { order.push_back(i); });
+		pool.wait();
+		REQUIRE(order.size() == 100);
+	}
+	REQUIRE(std::is_sorted(order.begin(), order.end())); // taken in submission order
+
+	std::atomic<int> sum{ 0 };
+	thread_pool pool(4);
+	for (int i = 1; i <= 1000; i++)
+		pool.submit([&sum, i] { sum += i; });
+	pool.wait();
+	REQUIRE(sum == 500500);
+}
+
+TEST_CASE("Batch assembly") {
+	using namespace ASM;
+	std::vector<string> inputs;
+	for (const auto& entry : fs::directory_iterator(tests_path))
+		if (entry.path().extension() == ".s")
+			inputs.push_back(entry.path().string());
+	std::sort(inputs.begin(), inputs.end());
+	{
+		std::ofstream broken("broken.s", std::ios::out | std::ios::trunc);
+		broken << ".text\nmov r1, r2\n.text\n";
+	}
+	inputs.insert(inputs.begin() + 1, "broken.s");
+	fs::create_directory("batch");
+
+	std::ostringstream first_log, first_error;
+	for (size_t jobs : { 1, 4 }) {
+		std::ostringstream log, error;
+		stats_t total;
+		REQUIRE(assemble_batch(inputs, "batch", jobs, parser_engine::LEXER, object_format::TEXT, log, error, total) == 1);
+		for (auto& input : inputs)
+			if (input != "broken.s")
+				REQUIRE(compareFiles(batch_output(input, "batch"), input.substr(0, input.size() - 2) + ".o"));
+		REQUIRE(error.str().find("broken.s: Invalid syntax detected. Symbol redecleration not allowed. Section already exsits @ line:3") == 0);
+		if (jobs == 1) {
+			first_log << log.str();
+			first_error << error.str();
+		}
+		// results do not depend on the thread count
+		REQUIRE(log.str() == first_log.str());
+		REQUIRE(error.str() == first_error.str());
+	}
+
+	REQUIRE(batch_output("dir/a.s", "") == "dir/a.o");
+	REQUIRE(batch_output("a.s", "out/") == "out/a.o");
+	stats_t total;
+	std::ostringstream sink;
+	REQUIRE_THROWS(assemble_batch({ "a/x.s", "b/x.s" }, "batch", 2, parser_engine::LEXER, object_format::TEXT, sink, sink, total));
+	// a missing source fails on its own, the others are still written
+	REQUIRE(assemble_batch({ "missing.s", inputs.back() }, "batch", 2, parser_engine::LEXER, object_format::TEXT, sink, sink, total) == 1);
+	REQUIRE(sink.str().find("missing.s: Cannot open source file missing.s") != string::npos);
+	REQUIRE(compareFiles(batch_output(inputs.back(), "batch"), inputs.back().substr(0, inputs.back().size() - 2) + ".o"));
+	fs::remove_all("batch");
+	std::remove("broken.s");
+
+	// a fresh outdir is created with its parents before anything is assembled
+	REQUIRE(assemble_batch({ inputs.back() }, "fresh/out/", 1, parser_engine::LEXER, object_format::TEXT, sink, sink, total) == 0);
+	REQUIRE(compareFiles(batch_output(inputs.back(), "fresh/out/"), inputs.back().substr(0, inputs.back().size() - 2) + ".o"));
+	{
+		std::ofstream file("fresh/file");
+	}
+	REQUIRE_THROWS(assemble_batch({ inputs.back() }, "fresh/file", 1, parser_engine::LEXER, object_format::TEXT, sink, sink, total));
+	fs::remove_all("fresh");
+}
+
+TEST_CASE("Batch file I/O") {
+	using namespace ASM;
+	std::vector<std::unique_ptr<file_io>> backends;
+	backends.push_back(std::make_unique<pread_io>(2));
+	try {
+		backends.push_back(std::make_unique<uring_io>());
+	} catch (std::system_error&) {
+		WARN("io_uring is not available, only the pread backend is checked");
+	}
+	string contents(100000, '\0');
+	for (size_t i = 0; i < contents.size(); i++)
+		contents[i] = (char)(i * 7);
+
+	for (auto& io : backends) {
+		INFO(io->name());
+		std::mutex lock;
+		std::condition_variable changed;
+		size_t completed = 0;
+		std::vector<string> errors(3), results(2);
+		auto done = [&](size_t slot, string data, const string& error) {
+			std::lock_guard<std::mutex> guard(lock);
+			errors[slot] = error;
+			if (slot < results.size())
+				results[slot] = std::move(data);
+			completed++;
+			changed.notify_all();
+		};
+		auto wait_for = [&](size_t count) {
+			std::unique_lock<std::mutex> guard(lock);
+			changed.wait(guard, [&] { return completed == count; });
+		};
+
+		io->write("io_big.bin", contents, [&](const string& error) { done(0, {}, error); });
+		io->write("io_empty.bin", {}, [&](const string& error) { done(1, {}, error); });
+		io->write("no/such/dir/out.bin", "x", [&](const string& error) { done(2, {}, error); });
+		wait_for(3);
+		REQUIRE(errors[0].empty());
+		REQUIRE(errors[1].empty());
+		REQUIRE(errors[2].find("Cannot open output file no/such/dir/out.bin") == 0);
+
+		io->read("io_big.bin", [&](string data, const string& error) { done(0, std::move(data), error); });
+		io->read("io_empty.bin", [&](string data, const string& error) { done(1, std::move(data), error); });
+		io->read("io_missing.bin", [&](string data, const string& error) { done(2, std::move(data), error); });
+		wait_for(6);
+		REQUIRE(errors[0].empty());
+		REQUIRE(results[0] == contents);
+		REQUIRE(errors[1].empty());
+		REQUIRE(results[1].empty());
+		REQUIRE(errors[2].find("Cannot open source file io_missing.bin") == 0);
+
+		// pipes have no size, both backends read them until the writer closes its end
+		::mkfifo("io_fifo", 0644);
+		std::thread writer([&contents] {
+			std::ofstream fifo("io_fifo", std::ios::out | std::ios::binary);
+			fifo << contents;
+		});
+		io->read("io_fifo", [&](string data, const string& error) { done(0, std::move(data), error); });
+		wait_for(7);
+		writer.join();
+		std::remove("io_fifo");
+		REQUIRE(errors[0].empty());
+		REQUIRE(results[0] == contents);
+	}
+	std::remove("io_big.bin");
+	std::remove("io_empty.bin");
+}
+
+
+TEST_CASE("Object cache") {
+	using namespace ASM;
+	fs::remove_all("cache");
+	object_cache cache("cache", 1 << 20);
+	auto silent_build = [&cache](Assembler& assembler, const string& text) {
+		std::ostringstream log;
+		assembler.log = &log;
+		assembler.cache = &cache;
+		return assembler.build(source_file(source_file::in_memory, text));
+	};
+
+	// keys follow the source bytes and the options
+	REQUIRE(object_cache::key("mov r1, r2", "a") == object_cache::key("mov r1, r2", "a"));
+	REQUIRE(object_cache::key("mov r1, r2", "a") != object_cache::key("mov r1, r3", "a"));
+	REQUIRE(object_cache::key("mov r1, r2", "a") != object_cache::key("mov r1, r2", "b"));
+	REQUIRE(object_cache::key("", "").size() == 64);
+	REQUIRE(sha256{}.update("abc").hex() == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+	REQUIRE(sha256{}.update(string(1000, 'a')).hex() == sha256{}.update(string(300, 'a')).update(string(700, 'a')).hex());
+	REQUIRE(sha256{}.update(string(56, 'a')).hex() == "b35439a4ac6f0948b6d6f9e3c6af0f5f590ce20f1bde7090ef7970686ec6738a");
+	REQUIRE(build_version().size() == 64);
+
+	string source = ".data\nnum: .word 5\n.text\nstart: call $start\n";
+	Assembler assembler("cached.s", "cached.o");
+	string object = silent_build(assembler, source);
+	REQUIRE(assembler.stats.cache_misses == 1);
+	REQUIRE(assembler.symtable.has("num"));
+
+	assembler.reset("cached.s", "cached.o");
+	REQUIRE(silent_build(assembler, source) == object);
+	REQUIRE(assembler.stats.cache_hits == 1);
+	REQUIRE(assembler.stats.lines == 0); // passes did not run
+	REQUIRE(!assembler.symtable.has("num"));
+
+	assembler.reset("cached.s", "cached.o", parser_engine::LEXER, object_format::BINARY);
+	REQUIRE(silent_build(assembler, source) != object);
+	REQUIRE(assembler.stats.cache_misses == 1);
+
+	// only a parsed .incbin keeps an object out of the cache, not the word in a name
+	{
+		std::ofstream blob("cached.bin", std::ios::out | std::ios::binary);
+		blob << "AB";
+	}
+	for (string text : { ".data\n.INCBIN \"cached.bin\"\n", ".data\nincbin_table: .word 1\n" }) {
+		bool included = text.find("cached.bin") != string::npos;
+		assembler.reset("cached.s", "cached.o");
+		silent_build(assembler, text);
+		REQUIRE(assembler.included == included);
+		REQUIRE(assembler.stats.cache_misses == (included ? 0 : 1));
+		assembler.reset("cached.s", "cached.o");
+		silent_build(assembler, text);
+		REQUIRE(assembler.stats.cache_hits == (included ? 0 : 1));
+	}
+	std::remove("cached.bin");
+
+	// batch runs report hits of all files
+	std::vector<string> inputs;
+	for (const auto& entry : fs::directory_iterator(tests_path))
+		if (entry.path().extension() == ".s")
+			inputs.push_back(entry.path().string());
+	fs::create_directory("batch");
+	for (size_t hits : { 0, 1 }) {
+		stats_t total;
+		std::ostringstream sink;
+		REQUIRE(assemble_batch(inputs, "batch", 2, parser_engine::LEXER, object_format::TEXT, sink, sink, total, &cache) == 0);
+		REQUIRE(total.cache_hits == hits * inputs.size());
+		REQUIRE(total.cache_misses == (1 - hits) * inputs.size());
+		for (auto& input : inputs)
+			REQUIRE(compareFiles(batch_output(input, "batch"), input.substr(0, input.size() - 2) + ".o"));
+	}
+	fs::remove_all("batch");
+
+	// servers report the counters of every request
+	{
+		string socket = (fs::current_path() / "cache.sock").string();
+		auto server = assembly_server(socket, 1, &cache);
+		std::thread serving([&server] { server->run(); });
+		remote::request_t request;
+		request.input = fs::absolute(inputs[0]);
+		request.output = fs::absolute("served.o");
+		remote::response_t response = remote::call(socket, request);
+		REQUIRE(response.cache);
+		REQUIRE(response.cache_hits == 1);
+		REQUIRE(response.cache_misses == 0);
+		request.command = "stop";
+		remote::call(socket, request);
+		serving.join();
+		std::remove("served.o");
+	}
+
+	REQUIRE(std::none_of(fs::directory_iterator("cache"), fs::directory_iterator(), [](auto& entry) {
+		return entry.path().filename().string()[0] == '.'; // no temporary files left behind
+	}));
+	fs::remove_all("cache");
+
+	// least recently used entries go first once the cache is over its size, ties are broken by name
+	fs::remove_all("lru");
+	object_cache small("lru", 3000);
+	vector<string> keys;
+	for (int i = 0; i < 4; i++) {
+		keys.push_back(object_cache::key(std::to_string(i), ""));
+		small.insert(keys[i], string(1000, 'a' + i));
+	}
+	auto used_at = [&small](const string& key, time_t second) {
+		timespec times[2] = { { second, 0 }, { second, 0 } };
+		REQUIRE(::utimensat(AT_FDCWD, small.entry(key).c_str(), times, 0) == 0);
+	};
+	used_at(keys[0], 4000);
+	used_at(keys[1], 1000);
+	used_at(keys[2], 2000);
+	used_at(keys[3], 3000);
+	small.trim();
+	REQUIRE(!fs::exists(small.entry(keys[1])));
+	REQUIRE(small.lookup(keys[2]) == string(1000, 'c')); // now the most recently used
+	object_cache(string("lru"), 2000).trim();
+	REQUIRE(!fs::exists(small.entry(keys[3])));
+	REQUIRE(fs::exists(small.entry(keys[0])));
+	REQUIRE(fs::exists(small.entry(keys[2])));
+
+	used_at(keys[0], 5000);
+	used_at(keys[2], 5000);
+	object_cache(string("lru"), 1000).trim();
+	REQUIRE(fs::exists(small.entry(std::max(keys[0], keys[2]))));
+	REQUIRE(!fs::exists(small.entry(std::min(keys[0], keys[2]))));
+	fs::remove_all("lru");
+}
+
+TEST_CASE("Assembler server") {
+	using namespace ASM;
+	string socket = (fs::current_path() / "server.sock").string();
+	auto server = assembly_server(socket, 2);
+	server->receive_timeout = std::chrono::milliseconds(200);
+	std::thread serving([&server] { server->run(); });
+	REQUIRE_THROWS(assembly_server(socket, 1)); // one server per socket
+
+	auto connect = [&socket]() {
+		sockaddr_un address = remote::socket_address(socket);
+		int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		REQUIRE(::connect(fd, (sockaddr*)&address, sizeof(address)) == 0);
+		return fd;
+	};
+	{
+		// clients that never send give their workers back after the timeout
+		remote::fd_t idle[] = { remote::fd_t(connect()), remote::fd_t(connect()) };
+		remote::request_t request;
+		request.command = "ping";
+		REQUIRE(remote::call(socket, request).diagnostics[0] == "Unknown request ping");
+		std::vector<string> fields;
+		REQUIRE(remote::receive_message(idle[0], fields));
+		REQUIRE(remote::decode_response(fields).diagnostics[0] == "Timed out waiting for message");
+
+		// the timeout covers the whole request, a byte now and then does not extend it
+		remote::fd_t slow(connect());
+		for (int i = 0; i < 6; i++) {
+			::send(slow, "\1", 1, MSG_NOSIGNAL);
+			std::this_thread::sleep_for(std::chrono::milliseconds(60));
+		}
+		REQUIRE(remote::receive_message(slow, fields));
+		REQUIRE(remote::decode_response(fields).diagnostics[0] == "Timed out waiting for message");
+
+		// lengths past the limit are refused before anything is allocated
+		remote::fd_t bogus(connect());
+		const char header[] = { 1, 0, 0, 0, '\xFF', '\xFF', '\xFF', '\xFF' };
+		remote::send_all(bogus, header, sizeof(header));
+		REQUIRE(remote::receive_message(bogus, fields));
+		REQUIRE(remote::decode_response(fields).diagnostics[0] == "Malformed message, larger than the limit");
+	}
+
+	// requests run concurrently, each worker reuses its assembler
+	std::vector<string> names;
+	for (const auto& entry : fs::directory_iterator(tests_path))
+		if (entry.path().extension() == ".s")
+			names.push_back(entry.path().filename().replace_extension(""));
+	std::vector<std::thread> clients;
+	std::vector<remote::response_t> responses(names.size() * 2);
+	for (size_t i = 0; i < responses.size(); i++) {
+		clients.emplace_back([&, i] {
+			remote::request_t request;
+			request.input = fs::absolute(tests_path + "/" + names[i / 2] + ".s");
+			request.output = fs::absolute("served" + std::to_string(i) + ".o");
+			responses[i] = remote::call(socket, request);
+		});
+	}
+	for (auto& client : clients)
+		client.join();
+	for (size_t i = 0; i < responses.size(); i++) {
+		INFO(names[i / 2]);
+		string output = "served" + std::to_string(i) + ".o";
+		REQUIRE(responses[i].status == 0);
+		REQUIRE(responses[i].diagnostics.empty());
+		REQUIRE(responses[i].lines > 0);
+		REQUIRE(!responses[i].cache);
+		REQUIRE(compareFiles(output, tests_path + "/" + names[i / 2] + ".o"));
+		std::remove(output.c_str());
+	}
+
+	remote::request_t request;
+	request.input = fs::absolute("inline.s");
+	request.output = fs::absolute("served.o");
+	request.has_source = true;
+	request.source = ".text\nmov r1, r2\n.text\n";
+	remote::response_t response = remote::call(socket, request);
+	REQUIRE(response.status == 1);
+	REQUIRE(response.diagnostics.size() == 1);
+	REQUIRE(response.diagnostics[0].find("Section already exsits @ line:3") != string::npos);
+
+	request.source = ".data\nnum: .word 5\n";
+	request.format = "bin";
+	response = remote::call(socket, request);
+	REQUIRE(response.status == 0);
+	REQUIRE(response.log.find("#.data (2)") != string::npos);
+	std::ifstream binary("served.o", std::ios::in | std::ios::binary);
+	std::stringstream contents;
+	contents << binary.rdbuf();
+	REQUIRE(object::view(contents.str().data(), contents.str().size()).sections().size() == 1);
+
+	request.format = "elf";
+	REQUIRE(remote::call(socket, request).diagnostics[0] == "Unknown object format elf");
+
+	if (::geteuid() == 0) {
+		// other users may assemble but not stop the server, its socket is put where they can reach it
+		string shared = "/tmp/asm-server-" + std::to_string(::getpid()) + ".sock";
+		auto guarded = assembly_server(shared, 1);
+		std::thread guarding([&guarded] { guarded->run(); });
+		::chmod(shared.c_str(), 0777);
+		int result[2];
+		REQUIRE(::pipe(result) == 0);
+		pid_t child = ::fork();
+		if (child == 0) {
+			::close(result[0]);
+			char refused = 0;
+			if (::setuid(65534) == 0) {
+				remote::request_t stop;
+				stop.command = "stop";
+				try {
+					remote::response_t answer = remote::call(shared, stop);
+					refused = answer.diagnostics.size() == 1 && answer.diagnostics[0] == "Not allowed to stop the server";
+				} catch (std::exception&) {
+				}
+			}
+			while (::write(result[1], &refused, 1) < 0 && errno == EINTR);
+			::_exit(0);
+		}
+		::close(result[1]);
+		char refused = 0;
+		bool reported = ::read(result[0], &refused, 1) == 1;
+		::close(result[0]);
+		::waitpid(child, nullptr, 0);
+		remote::request_t stop;
+		stop.command = "stop";
+		remote::call(shared, stop);
+		guarding.join();
+		REQUIRE(reported);
+		REQUIRE(refused);
+	}
+
+	request.command = "stop";
+	REQUIRE(remote::call(socket, request).status == 0);
+	serving.join();
+	server.reset();
+	REQUIRE(!fs::exists(socket));
+	REQUIRE_THROWS_AS(remote::call(socket, request), remote::socket_error);
+	std::remove("served.o");
+}
+
 
 int main(int argc, char* argv[]) {
 	try {
@@ -210,9 +1328,21 @@ int main(int argc, char* argv[]) {
 			("o,output", "Output file", cxxopts::value<string>()->default_value("a.o"))
 			("h,help", "Print help")
 			("t,test", "Run tests", cxxopts::value<string>()->implicit_value(tests_path))
-			("source", "Source file", cxxopts::value<string>());
+			("b,bench", "Run benchmarks")
+			("parser", "Parser engine (lexer, regex)", cxxopts::value<string>()->default_value("lexer"))
+			("stats", "Print assembly statistics")
+			("format", "Object file format (text, bin)", cxxopts::value<string>()->default_value("text"))
+			("convert", "Convert object file SOURCE to the given format instead of assembling")
+			("j,jobs", "Assemble sources on N threads", cxxopts::value<size_t>()->default_value("1"))
+			("outdir", "Write an object file for every source into this directory", cxxopts::value<string>())
+			("serve", "Keep running and assemble requests sent to this Unix socket, -j of them at once", cxxopts::value<string>())
+			("connect", "Have the server at this Unix socket assemble SOURCE (- reads standard input)", cxxopts::value<string>())
+			("stop", "Stop the server given with --connect")
+			("cache", "Reuse objects of identical sources from this directory", cxxopts::value<string>())
+			("cache-size", "Most megabytes kept in the cache, least recently used objects are removed first", cxxopts::value<uint64_t>()->default_value("256"))
+			("source", "Source files", cxxopts::value<std::vector<string>>());
 
-		options.positional_help("<SOURCE>");
+		options.positional_help("<SOURCE>...");
 		options.parse_positional({ "source" });
 		auto result = options.parse(argc, argv);
 
@@ -229,9 +1359,102 @@ int main(int argc, char* argv[]) {
 			exit(0);
 		}
 
-		ASM::init(result["source"].as<string>(), result["output"].as<string>());
+		if (result.count("bench")) {
+			const char* args[] = { argv[0], "[benchmark]" };
+			Catch::Session().run(2, args);
+			exit(0);
+		}
 
-		ASM::assemble();
+		ASM::parser_engine engine = ASM::parse_engine(result["parser"].as<string>());
+		ASM::object_format format = ASM::parse_format(result["format"].as<string>());
+
+		std::unique_ptr<ASM::object_cache> cache;
+		if (result.count("cache"))
+			cache = std::make_unique<ASM::object_cache>(result["cache"].as<string>(), result["cache-size"].as<uint64_t>() << 20);
+
+		if (result.count("serve")) {
+			ASM::serve(result["serve"].as<string>(), std::max<size_t>(result["jobs"].as<size_t>(), 1), cache.get());
+			if (cache)
+				cache->trim();
+			exit(0);
+		}
+
+		if (result.count("connect")) {
+			// thin client, same arguments as a single file run but the server assembles
+			ASM::remote::request_t request;
+			if (result.count("stop")) {
+				request.command = "stop";
+			} else {
+				if (result.count("source") != 1 || result["source"].as<std::vector<string>>().size() != 1)
+					throw std::runtime_error("Client takes a single source file");
+				string source = result["source"].as<std::vector<string>>()[0];
+				request.input = fs::absolute(source);
+				request.output = fs::absolute(result["output"].as<string>());
+				request.parser = result["parser"].as<string>();
+				request.format = result["format"].as<string>();
+				if (source == "-") { // read from stdin, included files are relative to the working directory
+					std::stringstream contents;
+					contents << std::cin.rdbuf();
+					request.has_source = true;
+					request.source = contents.str();
+				}
+			}
+			ASM::remote::response_t response = ASM::remote::call(result["connect"].as<string>(), request);
+			std::cout << response.log;
+			for (auto& diagnostic : response.diagnostics)
+				std::cerr << diagnostic << '\n';
+			if (result.count("stats")) {
+				std::cerr << "lines: " << response.lines << '\n';
+				if (response.cache)
+					std::cerr << "cache: " << response.cache_hits << " hits, " << response.cache_misses << " misses\n";
+			}
+			exit(response.status);
+		}
+
+		if (!result.count("source"))
+			throw std::runtime_error("No source file given");
+		auto sources = result["source"].as<std::vector<string>>();
+		bool batch = sources.size() > 1 || result.count("outdir") || result.count("jobs");
+		if (batch && result.count("output"))
+			throw std::runtime_error("Output file cannot be given for a batch, use --outdir");
+
+		if (result.count("convert")) {
+			if (sources.size() != 1)
+				throw std::runtime_error("Convert takes a single object file");
+			ASM::convert(sources[0], result["output"].as<string>(), format);
+			exit(0);
+		}
+
+#ifdef ASM_COUNT_ALLOCATIONS
+		size_t allocated = allocations;
+#endif
+		if (batch) {
+			string outdir = result.count("outdir") ? result["outdir"].as<string>() : "";
+			if (ASM::assemble_batch(sources, outdir, result["jobs"].as<size_t>(), engine, format, std::cout, std::cerr, ASM::stats, cache.get())) {
+				if (cache)
+					cache->trim();
+				exit(1);
+			}
+		} else {
+			ASM::init(sources[0], result["output"].as<string>(), engine, format);
+			ASM::assembler.cache = cache.get();
+			ASM::assemble();
+		}
+#ifdef ASM_COUNT_ALLOCATIONS
+		allocated = allocations - allocated;
+#endif
+		if (cache)
+			cache->trim();
+
+		if (result.count("stats")) {
+			std::cerr << "lines: " << ASM::stats.lines << '\n';
+			std::cerr << "arena: " << ASM::stats.arena_bytes << " bytes\n";
+#ifdef ASM_COUNT_ALLOCATIONS
+			std::cerr << "allocations: " << allocated << " (" << (double)allocated / std::max<size_t>(ASM::stats.lines, 1) << " per line)\n";
+#endif
+			if (cache)
+				std::cerr << "cache: " << ASM::stats.cache_hits << " hits, " << ASM::stats.cache_misses << " misses\n";
+		}
 	}
 	catch (std::exception& ex) {
 		std::cerr << ex.what() << '\n';